@@ -0,0 +1,87 @@
+-- Per primitive cost of separate drawing calls against drawing.batch
+-- Run with: plf bench/batch.lua
+-- Primitives are kept tiny so the call overhead shows instead of the rasterizing
+width = 320
+height = 180
+fps = 0
+title = "Batch benchmark"
+
+local ffi = require("ffi")
+
+local primitives = 10000
+local rounds = 30
+
+local ops = drawing.ops
+local scene = {}
+
+math.randomseed(1)
+for i = 1, primitives do
+    local x, y = math.random(2, width - 6), math.random(2, height - 6)
+    local kind = i % 3
+    if kind == 0 then
+        scene[i] = {ops.circle, x, y, math.random(1, 2), math.random(1, 512)}
+    elseif kind == 1 then
+        scene[i] = {ops.line, x, y, x + math.random(0, 3), y + math.random(0, 3), math.random(1, 512)}
+    else
+        scene[i] = {ops.pixel, x, y, math.random(1, 512)}
+    end
+end
+
+-- Flat command list shared by the batched runs
+local flat = {}
+for i = 1, primitives do
+    for _, value in ipairs(scene[i]) do
+        flat[#flat + 1] = value
+    end
+end
+local flatCount = #flat
+
+local buffer = drawing.newBatch(flatCount)
+local commands = ffi.cast("int32_t *", buffer:pointer())
+
+local function separate()
+    for i = 1, primitives do
+        local c = scene[i]
+        local op = c[1]
+        if op == ops.circle then
+            drawing.circle(c[2], c[3], c[4], c[5])
+        elseif op == ops.line then
+            drawing.line(c[2], c[3], c[4], c[5], c[6])
+        else
+            drawing.pixel(c[2], c[3], c[4])
+        end
+    end
+end
+
+local function table()
+    drawing.batch(flat, flatCount)
+end
+
+-- Refills the command buffer every round, so this includes building the frame's commands
+local function ffiBuffer()
+    for i = 0, flatCount - 1 do
+        commands[i] = flat[i + 1]
+    end
+    drawing.batch(buffer, flatCount)
+end
+
+local order = {"separate", "table", "ffiBuffer"}
+local runs = {separate = separate, table = table, ffiBuffer = ffiBuffer}
+local results = {separate = 0, table = 0, ffiBuffer = 0}
+local round = 0
+
+function update(dt)
+    round = round + 1
+    for _, name in ipairs(order) do
+        local start = os.clock()
+        runs[name]()
+        results[name] = results[name] + (os.clock() - start)
+    end
+
+    if round == rounds then
+        for _, name in ipairs(order) do
+            print(string.format("%-10s %7.1f ns per primitive", name, results[name] / (primitives * rounds) * 1e9))
+        end
+        window.close()
+    end
+end
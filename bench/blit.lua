@@ -0,0 +1,85 @@
+-- Sprites per millisecond for each blit kernel, using see-through sprites so the masking is what's measured
+-- Run with: plf bench/blit.lua
+width = 640
+height = 360
+fps = 0
+title = "Blit benchmark"
+
+local rounds = 20
+local perRound = 2000
+
+-- A ring sprite: transparent outside and in the middle, like most game sprites
+local function ringSprite(size)
+    local half = size / 2
+    return texture.fromShader(function(x, y)
+        local d = (x - half) ^ 2 + (y - half) ^ 2
+        if d > half * half or d < (half / 2) ^ 2 then
+            return 0
+        end
+        return color.rgb(x % 8, y % 8, 5)
+    end, size, size)
+end
+
+-- The old table of rows, for comparison
+local function toRows(tex)
+    local rows = {}
+    for y = 0, tex:height() - 1 do
+        rows[y + 1] = {}
+        for x = 0, tex:width() - 1 do
+            rows[y + 1][x + 1] = tex:get(x, y)
+        end
+    end
+    return rows
+end
+
+local sizes = {16, 32, 64}
+local sprites = {}
+for i, size in ipairs(sizes) do
+    sprites[i] = ringSprite(size)
+end
+
+-- Fixed positions so every kernel draws the same thing, some hang off the edges
+math.randomseed(1)
+local positions = {}
+for i = 1, perRound do
+    positions[i] = {math.random(-32, width - 16), math.random(-32, height - 16)}
+end
+
+local function run(image)
+    local start = os.clock()
+    for r = 1, rounds do
+        for i = 1, perRound do
+            local p = positions[i]
+            drawing.rect(image, p[1], p[2])
+        end
+    end
+    local ms = (os.clock() - start) * 1000
+    return rounds * perRound / ms
+end
+
+local kernels = {"scalar", "sse2", "avx2"}
+local frame = 0
+
+function update(dt)
+    frame = frame + 1
+    if frame < 3 then
+        return -- Let startup settle
+    end
+
+    local original = drawing.simd()
+    for i, size in ipairs(sizes) do
+        local line = string.format("%2dx%-2d", size, size)
+        if size <= 32 then
+            drawing.simd(original)
+            line = line .. string.format("  table %8.1f", run(toRows(sprites[i])))
+        end
+        for _, name in ipairs(kernels) do
+            if pcall(drawing.simd, name) then
+                line = line .. string.format("  %s %8.1f", name, run(sprites[i]))
+            end
+        end
+        print(line .. "  sprites/ms")
+    end
+    drawing.simd(original)
+    window.close()
+end
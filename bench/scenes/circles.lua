@@ -0,0 +1,27 @@
+-- 1k filled drawing.circle calls, all on screen
+-- Scene for plf_bench: benchCalls and benchPixels are the work done each frame
+width = 640
+height = 360
+benchName = "circles"
+benchCalls = 1000
+
+local radius = 12
+local xs, ys, colors = {}, {}, {}
+math.randomseed(2)
+for i = 1, benchCalls do
+    xs[i], ys[i], colors[i] = math.random(radius, width - 1 - radius), math.random(radius, height - 1 - radius), math.random(1, 512)
+end
+
+-- Pixels in one circle, row by row the same way it is drawn
+local perCircle = 0
+for dy = -radius, radius do
+    perCircle = perCircle + 2 * math.floor(math.sqrt(radius * radius - dy * dy)) + 1
+end
+benchPixels = benchCalls * perCircle
+
+function update(dt)
+    local circle = drawing.circle
+    for i = 1, benchCalls do
+        circle(xs[i], ys[i], radius, colors[i])
+    end
+end
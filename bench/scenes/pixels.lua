@@ -0,0 +1,20 @@
+-- 10k drawing.pixel calls, so this is mostly the cost of a call
+-- Scene for plf_bench: benchCalls and benchPixels are the work done each frame
+width = 640
+height = 360
+benchName = "pixels"
+benchCalls = 10000
+benchPixels = benchCalls
+
+local xs, ys, colors = {}, {}, {}
+math.randomseed(1)
+for i = 1, benchCalls do
+    xs[i], ys[i], colors[i] = math.random(0, width - 1), math.random(0, height - 1), math.random(1, 512)
+end
+
+function update(dt)
+    local pixel = drawing.pixel
+    for i = 1, benchCalls do
+        pixel(xs[i], ys[i], colors[i])
+    end
+end
@@ -0,0 +1,20 @@
+-- texture.fromRom with the cache turned off, so every load decodes
+-- Scene for plf_bench, run against the ROM it generates (images b000 to b015, 64x64)
+width = 320
+height = 180
+benchName = "romLoads"
+benchCalls = 64
+benchPixels = benchCalls * 64 * 64
+
+texture.cacheBudget(0)
+
+local ids = {}
+for i = 0, 15 do
+    ids[#ids + 1] = string.format("b%03d", i)
+end
+
+function update(dt)
+    for i = 1, benchCalls do
+        texture.fromRom(ids[(i - 1) % #ids + 1])
+    end
+end
@@ -0,0 +1,13 @@
+-- Full screen drawing.shader run on every core
+-- Scene for plf_bench: benchCalls and benchPixels are the work done each frame
+width = 640
+height = 360
+benchName = "shader"
+benchCalls = 1
+benchPixels = width * height
+
+function update(dt)
+    drawing.shader(function(x, y)
+        return (x + y) % 512 + 1
+    end, true)
+end
@@ -0,0 +1,28 @@
+-- Large see-through sprites drawn with drawing.rect
+-- Scene for plf_bench: benchCalls and benchPixels are the work done each frame
+width = 640
+height = 360
+benchName = "sprites"
+benchCalls = 100
+
+local size = 96
+local sprite = texture.fromShader(function(x, y)
+    if (x + y) % 7 == 0 then
+        return 0
+    end
+    return color.rgb(x % 8, y % 8, 3)
+end, size, size)
+benchPixels = benchCalls * size * size
+
+local xs, ys = {}, {}
+math.randomseed(3)
+for i = 1, benchCalls do
+    xs[i], ys[i] = math.random(0, width - size), math.random(0, height - size)
+end
+
+function update(dt)
+    local rect = drawing.rect
+    for i = 1, benchCalls do
+        rect(sprite, xs[i], ys[i])
+    end
+end
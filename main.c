@@ -8,6 +8,28 @@
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
+#include "luajit.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define PLF_X86
+#include <immintrin.h>
+#endif
+// GCC and Clang only emit vector instructions inside functions marked for them, MSVC always can
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
 
 // Global variables
 SDL_Window *window = NULL;
@@ -17,11 +39,38 @@ SDL_Texture *texture = NULL;
 Uint32 *pixelsFront = NULL;
 Uint32 *pixelsBack = NULL;
 int bufferWidth = 0, bufferHeight = 0;
+int bufferStride = 0; // Pixels per row of pixelsBack, the locked texture can have padding
+// Draw straight into the locked streaming texture instead of copying a buffer into it every frame
+bool lockedRendering = false;
+bool textureLocked = false;
+// Keep the back buffer between frames instead of swapping and clearing it
+bool persistentCanvas = false;
+// Set once a script holds a raw pointer to pixelsBack, the buffers are then copied instead of swapped
+bool backBufferPinned = false;
 // Removed: double dt = 0.0; // Target frame duration in seconds
 lua_State *L = NULL;
 bool running = true;
 bool isFullscreen = false;
 const char *romPathGlobal = NULL;
+// No window, renderer or texture, frames only ever live in the buffers
+bool headless = false;
+// Run Lua on an update thread while the main thread uploads and presents the frame before
+bool pipelined = false;
+
+// What was asked for on the command line
+#define MAX_DUMP_FRAMES 64
+typedef struct LaunchOptions
+{
+    const char *scriptPath;
+    const char *romPath;
+    bool headless;
+    int frames;                       // Headless frames to run, 0 for no limit
+    double seconds;                   // Headless seconds to run, 0 for no limit
+    const char *output;               // Saved frames are output.bmp, or output_N.bmp for the ones in dumpFrames
+    int dumpFrames[MAX_DUMP_FRAMES];  // Frames to save, just the last one when empty
+    int dumpCount;
+    const char *tracePath;            // Record a trace from the start and save it here on exit, NULL for none
+} LaunchOptions;
 
 // Suppress flag
 bool suppress = false;
@@ -29,6 +78,460 @@ bool suppress = false;
 // Define global pixel format for color mapping
 SDL_PixelFormat *globalFormat = NULL;
 
+// Every encoded color mapped through globalFormat once at startup, 0 is transparent
+Uint32 paletteColors[513];
+
+// Packed texture: pixels are stored row by row in one block as RGBA, 0 is transparent
+#define TEXTURE_METATABLE "PLF.texture"
+typedef struct Texture
+{
+    int width;
+    int height;
+    int refCount; // Userdata handles and the ROM cache each hold a reference
+    bool opaque;  // No transparent pixels, so rows can be copied whole
+    bool shared;  // Handed out by the ROM cache, writes go to a private copy first
+    // Time and pixels spent drawing this texture, tile workers add to the pending counts and
+    // the main thread folds them into the totals
+    SDL_atomic_t pendingTicks;
+    SDL_atomic_t pendingPixels;
+    Uint64 blitCount;
+    Uint64 blitTicks;
+    Uint64 blitPixels;
+    Uint32 pixels[];
+} Texture;
+
+// Commands understood by drawing.batch, also exposed to Lua as drawing.ops
+enum BatchOp
+{
+    BATCH_PIXEL = 1,
+    BATCH_LINE = 2,
+    BATCH_CIRCLE = 3,
+    BATCH_FILL_RECT = 4,
+};
+
+// Area of a pixel buffer that primitives may write to, max is exclusive
+typedef struct Canvas
+{
+    Uint32 *pixels;
+    int stride; // Pixels per row
+    int minX, minY;
+    int maxX, maxY;
+} Canvas;
+
+// Texture that primitives draw into instead of the screen, NULL for the screen
+Texture *drawTarget = NULL;
+
+// Bounding box of everything drawn into a buffer since it was cleared, max is inclusive.
+// Only this much has to be cleared and uploaded
+typedef struct DirtyRect
+{
+    int minX, minY;
+    int maxX, maxY; // Below min when nothing is dirty
+} DirtyRect;
+DirtyRect dirtyFront = {0, 0, -1, -1};
+DirtyRect dirtyBack = {0, 0, -1, -1};
+DirtyRect dirtyUploaded = {0, 0, -1, -1}; // What the SDL texture may still show from the last upload
+
+// Primitive recorded in deferred mode, replayed tile by tile at the end of the frame
+enum DrawCommandType
+{
+    DRAW_PIXEL,
+    DRAW_LINE,
+    DRAW_CIRCLE,
+    DRAW_FILL_RECT,
+    DRAW_BLIT,
+};
+typedef struct DrawCommand
+{
+    int type;
+    int args[6];
+    Uint32 color;
+    Texture *texture; // Held until the queue is flushed
+} DrawCommand;
+
+// Indices of the commands touching one tile, in submission order
+#define TILE_SIZE 64
+typedef struct TileBin
+{
+    int *commands;
+    int count;
+    int capacity;
+} TileBin;
+
+typedef struct DeferredQueue
+{
+    bool enabled;
+    DrawCommand *commands;
+    int commandCount;
+    int commandCapacity;
+    TileBin *tiles;
+    int tilesX, tilesY;
+} DeferredQueue;
+DeferredQueue deferred = {0};
+
+// ROM images packed into one texture, entries are sorted by id for lookups
+#define ATLAS_METATABLE "PLF.atlas"
+typedef struct AtlasEntry
+{
+    Uint32 id;
+    int x, y;
+    int width, height;
+} AtlasEntry;
+typedef struct Atlas
+{
+    Texture *texture;
+    int count;
+    AtlasEntry entries[];
+} Atlas;
+
+// Reusable command buffer for drawing.batch, LuaJIT's FFI can fill it through its pointer
+#define BATCH_METATABLE "PLF.batch"
+typedef struct CommandBuffer
+{
+    int capacity;
+    Sint32 commands[];
+} CommandBuffer;
+
+// ROM image directory entry, the pixel data points straight into the mapped file
+typedef struct RomImage
+{
+    bool used;
+    Uint32 id; // First 4 chars of the name, zero padded
+    unsigned int numPixels;
+    unsigned int width;
+    unsigned int height;
+    const Uint8 *pixels; // Little endian Uint16 per pixel
+    // Decoded texture shared by every texture.fromRom call, kept in least recently used order
+    Texture *cached;
+    struct RomImage *lruPrev;
+    struct RomImage *lruNext;
+} RomImage;
+
+// The ROM is mapped once at startup and its directory kept in an open addressed hash table
+typedef struct Rom
+{
+    const Uint8 *data;
+    size_t size;
+    RomImage *index;
+    Uint32 indexMask;
+    int imageCount;
+    const char *error; // Why the ROM could not be opened, reported by texture.fromRom
+} Rom;
+Rom rom = {0};
+
+// Decoded ROM textures are shared until they no longer fit in the budget
+typedef struct TextureCache
+{
+    RomImage *lruHead; // Most recently used
+    RomImage *lruTail; // Next to be evicted
+    size_t residentBytes;
+    size_t budget;
+    int entries;
+    Uint64 hits;
+    Uint64 misses;
+    Uint64 evictions;
+} TextureCache;
+#define DEFAULT_TEXTURE_BUDGET (64 * 1024 * 1024)
+TextureCache textureCache = {NULL, NULL, 0, DEFAULT_TEXTURE_BUDGET, 0, 0, 0, 0};
+
+// texture.loadAsync: ROM images decoded on a loader thread. Lua owns each request through its handle and the loader
+// only touches one between taking an image off it and marking that image ready, both under the lock
+#define LOAD_METATABLE "PLF.load"
+typedef struct LoadItem
+{
+    Uint32 id;
+    RomImage *image;
+    Texture *texture;  // Decoded by the loader, or the cached one when it was already there
+    const char *error; // Why it couldn't be decoded
+    bool ready;        // Set by the loader under the lock
+    bool collected;    // Handed to the cache on the Lua thread
+} LoadItem;
+typedef struct LoadRequest
+{
+    struct LoadRequest *next; // In the loader's queue
+    bool queued;
+    int count;
+    int nextItem;  // The next one for the loader to decode
+    int remaining; // Not ready yet
+    LoadItem items[];
+} LoadRequest;
+typedef struct AssetLoader
+{
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *wake;     // A request was queued or the loader is stopping
+    SDL_cond *finished; // An image is ready
+    LoadRequest *head, *tail;
+    LoadRequest *current; // Being decoded right now, freeing it has to wait
+    bool quitting;
+} AssetLoader;
+AssetLoader loader = {0};
+
+// Vector kernels picked at startup from what the CPU supports, drawing.simd can switch them
+typedef void (*FillSpanFunction)(Uint32 *dest, int count, Uint32 color);
+typedef void (*BlitSpanFunction)(Uint32 *dest, const Uint32 *src, int count);
+typedef struct SimdKernels
+{
+    const char *name;
+    FillSpanFunction fillSpan;
+    BlitSpanFunction blitSpan; // Copies every pixel that isn't transparent
+} SimdKernels;
+SimdKernels simd = {NULL, NULL, NULL};
+
+// Frame pacing works to absolute deadlines so sleep error doesn't add up over frames
+#define FRAME_SAMPLES 240
+#define PACE_SPIN_SECONDS 0.002 // Left to spin after sleeping, SDL_Delay can wake this late
+#define MAX_FIXED_STEPS 8       // fixedUpdate calls per frame before the backlog is dropped
+typedef struct FramePacer
+{
+    Uint64 deadline; // Performance counter value to present the next frame at, 0 to start over
+    Uint64 lastPresent;
+    double samples[FRAME_SAMPLES]; // Seconds between presents, oldest overwritten first
+    int sampleCount;
+    int nextSample;
+    double accumulator; // Time not yet simulated by fixedUpdate
+} FramePacer;
+FramePacer pacer = {0};
+
+// Where each frame's time and drawing went, kept over the last FRAME_SAMPLES frames for debug.stats
+typedef enum
+{
+    PHASE_EVENTS,  // Polling and the events callback
+    PHASE_UPDATE,  // fixedUpdate and update
+    PHASE_SWAP,    // Deferred drawing, swapping and clearing the buffers
+    PHASE_UPLOAD,  // Copying the frame into the texture
+    PHASE_PRESENT, // Drawing the texture to the window and presenting
+    PHASE_PACE,    // Waiting for the frame's slot
+    PHASE_COUNT
+} FramePhase;
+#define DRAW_TYPE_COUNT (DRAW_BLIT + 1)
+typedef struct FrameSample
+{
+    double phases[PHASE_COUNT]; // Seconds
+    Uint32 calls[DRAW_TYPE_COUNT]; // By DrawCommandType
+    Uint32 shaders;
+    Uint64 pixels; // Written by primitives and shaders
+    double luaKilobytes;
+} FrameSample;
+typedef struct FrameStats
+{
+    FrameSample samples[FRAME_SAMPLES];
+    int sampleCount;
+    int nextSample;
+    FrameSample current;
+    SDL_atomic_t tilePixels; // Written by deferred tile jobs, moved into current at the end of the frame
+    bool overlay;            // Draw the numbers in the top left corner
+    double latencies[FRAME_SAMPLES]; // Seconds from a frame being finished to it being presented
+    int latencyCount;
+    int nextLatency;
+} FrameStats;
+FrameStats frameStats = {0};
+
+// Sampling profiler for the main Lua state, on LuaJIT's own profiler. Its timer only flags the VM, which calls back on
+// the thread running Lua at the next safe point, and the callback records the stack collapsed (outermost frame first,
+// split by ;) the way flamegraph tools read it
+#define PROFILE_DEPTH 64
+#define PROFILE_FILE "profile.txt"
+typedef struct ProfileStack
+{
+    char *stack;
+    int count;
+} ProfileStack;
+typedef struct Profiler
+{
+    bool running;
+    int intervalMs;
+    bool insideLua;        // Set by the main loop around events and update, ticks outside are dropped
+    Uint64 sampledAt;      // Entering Lua or the last sample, ticks from before it are already counted or outside
+    ProfileStack *stacks;  // Open addressed on the stack text
+    int capacity;
+    int count;
+    int samples;
+} Profiler;
+Profiler profiler = {0};
+
+// Trace of the main loop's phases and the script's own zones, saved as Chrome trace events (chrome://tracing, Perfetto).
+// Only the last TRACE_CAPACITY zones are kept so a long session costs the same as a short one
+#define TRACE_CAPACITY 65536
+#define TRACE_DEPTH 32
+#define TRACE_NAME_SIZE 32
+#define TRACE_FILE "trace.json"
+#define TRACE_LOOP 1    // Where the frame loop and Lua run, the main thread unless pipelined
+#define TRACE_PRESENT 2 // The main thread presenting when pipelined
+typedef struct TraceEvent
+{
+    char name[TRACE_NAME_SIZE];
+    const char *category; // "loop", "lua" or "render"
+    int thread;           // TRACE_LOOP or TRACE_PRESENT
+    Uint64 start;         // Performance counter
+    Uint64 duration;
+} TraceEvent;
+typedef struct Tracer
+{
+    TraceEvent *events; // Ring of TRACE_CAPACITY, allocated on the first start
+    Uint64 written;     // Since the last start, the ring holds the newest TRACE_CAPACITY
+    Uint64 origin;      // Counter at the last start, timestamps count from here
+    bool recording;
+    char zoneNames[TRACE_DEPTH][TRACE_NAME_SIZE]; // Zones the script has begun but not finished
+    Uint64 zoneStarts[TRACE_DEPTH];
+    int depth;
+} Tracer;
+Tracer tracer = {0};
+
+// Frames handed from the update thread to the main thread when pipelined. SDL's render API has to stay on the thread
+// that made the window, so the main thread keeps the window, renderer and texture, polls events and presents, while
+// the update thread runs Lua and the frame loop. Lua's back buffer plus PIPELINE_FRAMES in flight (one waiting,
+// one being presented) makes three buffers, Lua only waits once both are still in use
+#define PIPELINE_FRAMES 2
+typedef enum
+{
+    FRAME_FREE,      // Lua can fill it
+    FRAME_QUEUED,    // Finished, waiting for the main thread
+    FRAME_PRESENTING // The main thread is uploading and presenting it
+} PipelineFrameState;
+typedef struct PipelineFrame
+{
+    Uint32 *pixels;
+    DirtyRect drawn;  // Everything on it that may not be zero, cleared when the buffer goes back to Lua
+    DirtyRect upload; // What the texture is missing from this frame
+    PipelineFrameState state;
+    Uint64 sequence;  // Frames are presented in the order they were finished
+    bool presented;   // The timings below haven't been picked up by the main thread yet
+    Uint64 submitted, uploadStart, uploadEnd, presentEnd;
+} PipelineFrame;
+typedef struct Pipeline
+{
+    SDL_Thread *thread; // The update thread
+    SDL_mutex *lock;
+    SDL_cond *changed;  // A frame was given back or a message box closed
+    Uint32 wakeEvent;   // Pushed to wake the main thread when a frame is queued or the window is asked to change
+    PipelineFrame frames[PIPELINE_FRAMES];
+    Uint64 nextSequence;
+    bool finished;      // The frame loop is over, nothing more gets queued
+
+    // Events from the main thread, handled by the update thread at the start of its next frame
+    SDL_Event *events;
+    int eventCount;
+    int eventCapacity;
+    SDL_Event *handling; // The batch the update thread is going through, swapped with events
+    int handlingCapacity;
+
+    // Window changes asked for from Lua, made by the main thread. -1 or NULL when nothing is asked
+    char *title;
+    int fullscreen;
+    int cursor;
+    bool centerMouse;
+    const char *message; // The update thread waits until the main thread has shown it and sets it back to NULL
+} Pipeline;
+Pipeline pipeline = {0};
+
+// Input events are collected while polling and handed to Lua in one call per frame
+typedef enum
+{
+    EVENT_MOUSE_DOWN,
+    EVENT_MOUSE_UP,
+    EVENT_MOUSE_MOVE,
+    EVENT_KEY_DOWN,
+    EVENT_KEY_UP,
+    EVENT_TEXT
+} EventType;
+typedef struct FrameEvent
+{
+    EventType type;
+    int button;         // 1, 2 or 3 for mouse buttons
+    bool inside;        // Whether x and y are on the buffer
+    int x, y, dx, dy;   // Buffer coordinates and motion since the last event
+    SDL_Scancode code;  // Physical key
+    char key[16];       // Key name spelt the way keyboard.down takes it
+    bool repeated;      // Key held down long enough to repeat
+    char text[32];      // UTF-8 from text input
+} FrameEvent;
+typedef struct EventQueue
+{
+    FrameEvent *events;
+    int count;
+    int capacity;
+    int callbackRef; // events(list), looked up once after the script runs
+    int listRef;     // The array passed to events, reused every frame
+    int poolRef;     // Event tables, reused every frame
+    int poolSize;
+    int listLength;  // How many entries the list was left holding
+} EventQueue;
+EventQueue eventQueue = {NULL, 0, 0, LUA_NOREF, LUA_NOREF, LUA_NOREF, 0, 0};
+
+// Keys with names longer than one character, as keyboard.down spells them
+typedef struct NamedKey
+{
+    const char *name;
+    SDL_Scancode scancode;
+} NamedKey;
+const NamedKey namedKeys[] = {
+    {"enter", SDL_SCANCODE_RETURN},
+    {"shift", SDL_SCANCODE_LSHIFT},
+    {"shift", SDL_SCANCODE_RSHIFT},
+    {"control", SDL_SCANCODE_LCTRL},
+    {"control", SDL_SCANCODE_RCTRL},
+    {"alt", SDL_SCANCODE_LALT},
+    {"alt", SDL_SCANCODE_RALT},
+    {"escape", SDL_SCANCODE_ESCAPE},
+    {"back", SDL_SCANCODE_BACKSPACE},
+    {"tab", SDL_SCANCODE_TAB},
+    {"left", SDL_SCANCODE_LEFT},
+    {"right", SDL_SCANCODE_RIGHT},
+    {"up", SDL_SCANCODE_UP},
+    {"down", SDL_SCANCODE_DOWN}};
+
+// Window to buffer mapping for the mouse, worked out again only when the window changes size
+typedef struct MouseTransform
+{
+    bool valid;
+    int offsetX, offsetY; // Where the letterboxed buffer starts in the window
+    float scaleX, scaleY; // Buffer pixels per window pixel
+} MouseTransform;
+MouseTransform mouseTransform = {false, 0, 0, 1.0f, 1.0f};
+int snapshotRef = LUA_NOREF; // Table input.snapshot fills in, reused between calls
+
+// Pool of helper threads, the calling thread joins in as worker 0
+typedef void (*JobFunction)(void *context, int job, int worker);
+typedef struct WorkerPool
+{
+    SDL_Thread **threads;
+    int threadCount;
+    SDL_mutex *lock;
+    SDL_cond *wake;
+    SDL_cond *done;
+    JobFunction function;
+    void *context;
+    int jobCount;
+    SDL_atomic_t nextJob;
+    int pending;    // Helper threads still working on the current batch
+    int generation; // Bumped for every batch so sleeping threads know to wake
+    bool quitting;
+} WorkerPool;
+WorkerPool workerPool = {0};
+
+// Worker copies of the parallel shader, each worker runs its own Lua state
+typedef struct ShaderWorkers
+{
+    lua_State **states;
+    int *functionRefs;
+    double *busySeconds;
+    char *bytecode; // Dump of the loaded function, reloaded only when it changes
+    size_t bytecodeSize;
+    size_t bytecodeCapacity;
+    bool failed; // The loaded function can't run in parallel, already reported
+    SDL_atomic_t missedGlobal; // A worker touched a global it doesn't have, the call is redone on the main state
+    // Timing of the last parallel call
+    double wallSeconds;
+    double totalBusySeconds;
+    // Every so often one band also runs on the script's state, so the speedup compares against one thread
+    int calls;
+    int sampledBands; // Bands timed since the shader or the band count changed
+    int sampledCount; // Band count they were timed with
+    double sampledSeconds;
+} ShaderWorkers;
+ShaderWorkers shaderWorkers = {0};
+
 #define LOG(fmt, ...)                                                           \
     do                                                                          \
     {                                                                           \
@@ -45,27 +548,125 @@ SDL_PixelFormat *globalFormat = NULL;
 // Function declarations
 void InitializeLua(const char *scriptPath);
 void SetupBuffers(int width, int height);
-void UpdatePixelsFromLua(double deltaTime); // Changed parameter name
+void UpdatePixelsFromLua(double deltaTime, double alpha); // Changed parameter name
+double RunFixedUpdates(double deltaTime);
+void FinishFrame();
+void PaceFrame(double period);
+void RecordFrameTime();
+void EndPhase(FramePhase phase, Uint64 *mark);
+void RecordFrameStats();
+void DrawStatsOverlay();
+bool StartProfiler(int intervalMs);
+void StopProfiler();
+void SetProfilerInsideLua(bool inside);
+void ClearProfile();
+bool SaveProfile(const char *path);
+void ToggleProfiler();
+void TraceZone(const char *name, const char *category, int thread, Uint64 start, Uint64 end);
+bool StartTrace();
+void StopTrace();
+bool SaveTrace(const char *path);
+void ToggleTrace();
+void QueueEvent(const SDL_Event *e);
+void DispatchEvents();
+void FreeEvents();
 void DrawBuffer();
+bool StartPipeline();
+void StopPipeline();
+int RunPipelined(LaunchOptions *options);
+void WakeMainThread();
+void SubmitFrame();
+void CollectPresentedFrames();
+void HandleEvent(const SDL_Event *e);
+void SetFullscreen(bool fullscreen);
+void CenterMouse();
+void ShowMessage(const char *text);
+int RunFrames(void *data);
+void RecordLatency(double seconds);
+bool ParseArguments(int argc, char *argv[], LaunchOptions *options);
+bool OpenWindow(const char *title);
+double TargetFramePeriod();
+bool SaveFrame(const char *path);
+void LockBackBuffer();
+void UnlockBackBuffer();
+bool StopLockedRendering();
+void RegisterColorLibrary(lua_State *L);
+void RegisterUtilLibrary(lua_State *L);
 int color_rgb(lua_State *L);
 int color_hsv(lua_State *L);
 int color_greyscale(lua_State *L);
 int texture_fromShader(lua_State *L);
 int texture_fromRom(lua_State *L);
+int texture_loadAsync(lua_State *L);
+int load_poll(lua_State *L);
+int load_wait(lua_State *L);
+int load_get(lua_State *L);
+int load_gc(lua_State *L);
+int texture_fromTable(lua_State *L);
+int texture_cacheStats(lua_State *L);
+int texture_cacheBudget(lua_State *L);
+int texture_atlas(lua_State *L);
+int texture_width(lua_State *L);
+int texture_height(lua_State *L);
+int texture_get(lua_State *L);
+int texture_set(lua_State *L);
+int texture_copy(lua_State *L);
+int texture_stats(lua_State *L);
+int texture_gc(lua_State *L);
+int atlas_texture(lua_State *L);
+int atlas_rect(lua_State *L);
+int atlas_gc(lua_State *L);
 int drawing_shader(lua_State *L);
+int drawing_shaderStats(lua_State *L);
+int drawing_buffer(lua_State *L);
+int drawing_palette(lua_State *L);
 int drawing_rect(lua_State *L);
+int drawing_sprite(lua_State *L);
 int drawing_circle(lua_State *L);
 int drawing_line(lua_State *L);
 int drawing_pixel(lua_State *L);
+int drawing_fillRect(lua_State *L);
+int drawing_simd(lua_State *L);
+int drawing_batch(lua_State *L);
+int drawing_newBatch(lua_State *L);
+int drawing_deferred(lua_State *L);
+int drawing_flush(lua_State *L);
+int drawing_persistent(lua_State *L);
+int drawing_clear(lua_State *L);
+int drawing_target(lua_State *L);
+int batch_pointer(lua_State *L);
+int batch_capacity(lua_State *L);
+int batch_set(lua_State *L);
 int mouse_position(lua_State *L);
+bool WindowToBuffer(int x, int y, int *bufferX, int *bufferY);
+void UpdateMouseTransform();
+SDL_Scancode FindNamedKey(const char *name);
+SDL_Scancode CharacterScancode(int character);
+void PushKeyTable(lua_State *L);
+void FillCharacterKeys(lua_State *L);
 int mouse_down(lua_State *L);
 int mouse_center(lua_State *L);
 int mouse_visible(lua_State *L);
 int keyboard_down(lua_State *L);
+int input_snapshot(lua_State *L);
+int debug_stats(lua_State *L);
+int debug_overlay(lua_State *L);
+int profiler_start(lua_State *L);
+int profiler_stop(lua_State *L);
+int profiler_running(lua_State *L);
+int profiler_report(lua_State *L);
+int profiler_save(lua_State *L);
+int trace_start(lua_State *L);
+int trace_stop(lua_State *L);
+int trace_recording(lua_State *L);
+int trace_begin(lua_State *L);
+int trace_finish(lua_State *L);
+int trace_save(lua_State *L);
 int window_title(lua_State *L);
 int window_close(lua_State *L);
 int window_fullscreen(lua_State *L);
 int window_message(lua_State *L);
+int window_frameStats(lua_State *L);
 int http_get(lua_State *L);
 int util_distance(lua_State *L);
 int util_random(lua_State *L);
@@ -76,6 +677,52 @@ int util_intersect(lua_State *L);
 // Helper functions
 int EncodeColor(int rIndex, int gIndex, int bIndex);
 Uint32 DecodeColor(int encodedColor);
+void BuildPalette();
+Uint32 TexturePixel(int encodedColor);
+Texture *AllocTexture(int width, int height);
+void RetainTexture(Texture *tex);
+void ReleaseTexture(Texture *tex);
+void PushTexture(lua_State *L, Texture *tex);
+Texture *CheckTexture(lua_State *L, int idx);
+Texture *CheckWritableTexture(lua_State *L, int idx);
+void UpdateTextureOpacity(Texture *tex);
+Canvas ScreenCanvas();
+Canvas TargetCanvas();
+int BlitTexture(const Canvas *canvas, Texture *tex, int srcX, int srcY, int width, int height, int xOffset, int yOffset);
+int DrawCircle(const Canvas *canvas, int centerX, int centerY, int radius, Uint32 color);
+int DrawLine(const Canvas *canvas, int x1, int y1, int x2, int y2, Uint32 color);
+int DrawPixel(const Canvas *canvas, int x, int y, Uint32 color);
+int DrawFillRect(const Canvas *canvas, int x, int y, int width, int height, Uint32 color);
+bool SelectSimd(const char *name);
+void SubmitBlit(Texture *tex, int srcX, int srcY, int width, int height, int xOffset, int yOffset);
+void SubmitCircle(int centerX, int centerY, int radius, Uint32 color);
+void SubmitLine(int x1, int y1, int x2, int y2, Uint32 color);
+void SubmitPixel(int x, int y, Uint32 color);
+void SubmitFillRect(int x, int y, int width, int height, Uint32 color);
+void FlushDeferred();
+void FreeDeferred();
+void MarkDirty(int minX, int minY, int maxX, int maxY);
+void MarkAllDirty();
+void UniteDirty(DirtyRect *rect, const DirtyRect *other);
+void ClearDirty(Uint32 *pixels, DirtyRect *rect);
+bool OpenRom(const char *path);
+void CloseRom();
+Uint32 RomImageId(const char *name);
+RomImage *FindRomImage(const char *name);
+RomImage *FindRomImageById(Uint32 id);
+void DecodeRomImage(const RomImage *image, Uint32 *dest);
+size_t TextureBytes(const Texture *tex);
+void CacheRomTexture(RomImage *image, Texture *tex);
+void TouchCachedTexture(RomImage *image);
+void EvictTextures(size_t budget);
+int WorkerCount();
+void StartWorkerPool();
+void StopWorkerPool();
+void RunJobs(JobFunction function, void *context, int jobCount);
+bool StartAssetLoader();
+void StopAssetLoader();
+bool PrepareParallelShader(lua_State *L, int idx);
+void CloseParallelShader();
 
 // Custom function to check if a number is an integer
 int lua_isinteger_custom(lua_State *L, int idx)
@@ -104,993 +751,5803 @@ Uint32 DecodeColor(int encodedColor)
     if (encodedColor < 1 || encodedColor > 512)
     {
         LOG("Encoded color value out of range: %d\n", encodedColor);
-        return SDL_MapRGBA(globalFormat, 0, 0, 0, 255); // Default to black
+        return paletteColors[1]; // Default to black
     }
 
-    int encodedValue = encodedColor - 1;
-    int rIndex = encodedValue / 64;
-    int gIndex = (encodedValue % 64) / 8;
-    int bIndex = encodedValue % 8;
-
-    Uint8 r = rIndex * 36;
-    Uint8 g = gIndex * 36;
-    Uint8 b = bIndex * 36;
-    Uint8 a = 255;
-
-    return SDL_MapRGBA(globalFormat, r, g, b, a);
+    return paletteColors[encodedColor];
 }
 
-// Initialize Lua and register functions
-void InitializeLua(const char *scriptPath)
+// Build the palette table, the draw loops index it directly instead of decoding every pixel
+void BuildPalette()
 {
-    L = luaL_newstate();
-    luaL_openlibs(L);
+    paletteColors[0] = 0;
+    for (int encodedValue = 0; encodedValue < 512; encodedValue++)
+    {
+        int rIndex = encodedValue / 64;
+        int gIndex = (encodedValue % 64) / 8;
+        int bIndex = encodedValue % 8;
 
-    // Register color library
-    luaL_Reg colorLib[] = {
-        {"rgb", color_rgb},
-        {"hsv", color_hsv},
-        {"greyscale", color_greyscale},
-        {NULL, NULL}};
-    luaL_newlib(L, colorLib);
-    lua_setglobal(L, "color");
+        Uint8 r = rIndex * 36;
+        Uint8 g = gIndex * 36;
+        Uint8 b = bIndex * 36;
+        Uint8 a = 255;
 
-    // Register drawing library
-    luaL_Reg drawingLib[] = {
-        {"shader", drawing_shader},
-        {"rect", drawing_rect},
-        {"circle", drawing_circle},
-        {"line", drawing_line},
-        {"pixel", drawing_pixel},
-        {NULL, NULL}};
-    luaL_newlib(L, drawingLib);
-    lua_setglobal(L, "drawing");
+        paletteColors[encodedValue + 1] = SDL_MapRGBA(globalFormat, r, g, b, a);
+    }
+}
 
-    // Register texture library
-    luaL_Reg textureLib[] = {
-        {"fromShader", texture_fromShader},
-        {"fromRom", texture_fromRom},
-        {NULL, NULL}};
-    luaL_newlib(L, textureLib);
-    lua_setglobal(L, "texture");
+// Convert an encoded color to a packed texture pixel, anything out of range is transparent
+Uint32 TexturePixel(int encodedColor)
+{
+    if (encodedColor < 1 || encodedColor > 512)
+        return 0;
 
-    // Register mouse library
-    luaL_Reg mouseLib[] = {
-        {"position", mouse_position},
-        {"down", mouse_down},
-        {"visible", mouse_visible},
-        {"center", mouse_center},
-        {NULL, NULL}};
-    luaL_newlib(L, mouseLib);
-    lua_setglobal(L, "mouse");
+    return paletteColors[encodedColor];
+}
 
-    // Register keyboard library
-    luaL_Reg keyboardLib[] = {
-        {"down", keyboard_down},
-        {NULL, NULL}};
-    luaL_newlib(L, keyboardLib);
-    lua_setglobal(L, "keyboard");
+Texture *AllocTexture(int width, int height)
+{
+    Texture *tex = (Texture *)calloc(1, sizeof(Texture) + (size_t)width * height * sizeof(Uint32));
+    if (!tex)
+        return NULL;
+
+    tex->width = width;
+    tex->height = height;
+    tex->refCount = 1;
+    tex->opaque = false;
+    return tex;
+}
 
-    // Register window library
-    luaL_Reg windowLib[] = {
-        {"title", window_title},
-        {"close", window_close},
-        {"fullscreen", window_fullscreen},
-        {"message", window_message},
-        {NULL, NULL}};
-    luaL_newlib(L, windowLib);
-    lua_setglobal(L, "window");
+void RetainTexture(Texture *tex)
+{
+    tex->refCount++;
+}
 
-    // Register util library
-    luaL_Reg utilLib[] = {
-        {"distance", util_distance},
-        {"clamp", util_clamp},
-        {"lerp", util_lerp},
-        {"random", util_random},
-        {"httpGet", http_get},
-        {"intersect", util_intersect},
-        {NULL, NULL}};
-    luaL_newlib(L, utilLib);
-    lua_setglobal(L, "util");
+void ReleaseTexture(Texture *tex)
+{
+    if (--tex->refCount == 0)
+        free(tex);
+}
 
-    // Load and execute the Lua script
-    if (luaL_dofile(L, scriptPath))
-    {
-        LOG("Lua Error: %s\n", lua_tostring(L, -1));
-        lua_close(L);
-        L = NULL;
-    }
+// Wrap a texture in a userdata, the userdata takes over the caller's reference
+void PushTexture(lua_State *L, Texture *tex)
+{
+    Texture **box = (Texture **)lua_newuserdata(L, sizeof(Texture *));
+    *box = tex;
+    luaL_getmetatable(L, TEXTURE_METATABLE);
+    lua_setmetatable(L, -2);
 }
 
-void SetupBuffers(int width, int height)
+Texture *CheckTexture(lua_State *L, int idx)
 {
-    bufferWidth = width;
-    bufferHeight = height;
+    Texture **box = (Texture **)luaL_checkudata(L, idx, TEXTURE_METATABLE);
+    return *box;
+}
 
-    // Allocate double pixel buffers
-    pixelsFront = (Uint32 *)malloc(bufferWidth * bufferHeight * sizeof(Uint32));
-    pixelsBack = (Uint32 *)malloc(bufferWidth * bufferHeight * sizeof(Uint32));
-    if (!pixelsFront || !pixelsBack)
+// Texture of the handle at idx, ready to be changed. A ROM texture other holders (or the cache) can still
+// see is swapped for a private copy first, so changes never leak into other fromRom results
+Texture *CheckWritableTexture(lua_State *L, int idx)
+{
+    Texture **box = (Texture **)luaL_checkudata(L, idx, TEXTURE_METATABLE);
+    Texture *tex = *box;
+    if (!tex->shared)
+        return tex;
+    if (tex->refCount == 1)
     {
-        LOG("Failed to allocate pixel buffers.\n");
-        exit(1);
+        // Already dropped from the cache and nobody else has it
+        tex->shared = false;
+        return tex;
     }
-    memset(pixelsFront, 0, bufferWidth * bufferHeight * sizeof(Uint32));
-    memset(pixelsBack, 0, bufferWidth * bufferHeight * sizeof(Uint32));
 
-    // Create texture with matching pixel format
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, bufferWidth, bufferHeight);
-    if (!texture)
+    Texture *copy = AllocTexture(tex->width, tex->height);
+    if (!copy)
     {
-        LOG("Failed to create texture: %s\n", SDL_GetError());
-        free(pixelsFront);
-        free(pixelsBack);
-        exit(1);
+        luaL_error(L, "Failed to allocate memory for texture");
+        return NULL;
     }
+    memcpy(copy->pixels, tex->pixels, (size_t)tex->width * tex->height * sizeof(Uint32));
+    copy->opaque = tex->opaque;
+    ReleaseTexture(tex);
+    *box = copy;
+    return copy;
 }
 
-// Update pixels by calling Lua's update function with deltaTime
-void UpdatePixelsFromLua(double deltaTime)
+// Scan a texture once so fully opaque ones can be blitted a row at a time
+void UpdateTextureOpacity(Texture *tex)
 {
-    lua_getglobal(L, "update");
-    if (lua_isfunction(L, -1))
+    int count = tex->width * tex->height;
+    tex->opaque = true;
+    for (int i = 0; i < count; i++)
     {
-        lua_pushnumber(L, deltaTime);
-
-        if (lua_pcall(L, 1, 0, 0) != LUA_OK)
+        if (tex->pixels[i] == 0)
         {
-            LOG("Lua Error in 'update': %s\n", lua_tostring(L, -1));
-            lua_pop(L, 1);
+            tex->opaque = false;
+            break;
         }
     }
-    else
-    {
-        lua_pop(L, 1);
-        LOG("Lua 'update' function not found.\n"); // Debug print
-    }
 }
 
-void DrawBuffer()
+// Pack up to the first 4 chars of a name, stopping at the first NUL like strncmp does
+Uint32 RomImageId(const char *name)
 {
-    // Update the texture with the front buffer
-    SDL_UpdateTexture(texture, NULL, pixelsFront, bufferWidth * sizeof(Uint32));
+    Uint8 bytes[4] = {0};
+    for (int i = 0; i < 4 && name[i] != '\0'; i++)
+        bytes[i] = (Uint8)name[i];
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((Uint32)bytes[3] << 24);
+}
 
-    // Clear the renderer
-    SDL_RenderClear(renderer);
+static Uint32 ReadRomUint32(const Uint8 *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((Uint32)p[3] << 24);
+}
 
-    // Calculate scaling
-    int windowWidth, windowHeight;
-    SDL_GetWindowSize(window, &windowWidth, &windowHeight);
+static Uint32 HashRomImageId(Uint32 id)
+{
+    return id * 2654435761u;
+}
 
-    float bufferAspect = (float)bufferWidth / bufferHeight;
-    float windowAspect = (float)windowWidth / windowHeight;
+// Map the ROM file into memory, failures are kept in rom.error so scripts without a ROM still run
+bool OpenRom(const char *path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        rom.error = "Failed to open ROM file";
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < 5)
+    {
+        CloseHandle(file);
+        rom.error = "Invalid ROM file header";
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    const Uint8 *data = mapping ? (const Uint8 *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (mapping)
+        CloseHandle(mapping);
+    CloseHandle(file);
+    size_t size = (size_t)fileSize.QuadPart;
+    if (!data)
+    {
+        rom.error = "Failed to map ROM file";
+        return false;
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        rom.error = "Failed to open ROM file";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 5)
+    {
+        close(fd);
+        rom.error = "Invalid ROM file header";
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        rom.error = "Failed to map ROM file";
+        return false;
+    }
+    const Uint8 *data = (const Uint8 *)mapped;
+#endif
 
-    SDL_Rect destRect;
-    if (windowAspect > bufferAspect)
+    rom.data = data;
+    rom.size = size;
+    if (memcmp(data, "imag", 4) != 0)
     {
-        destRect.h = windowHeight;
-        destRect.w = (int)(windowHeight * bufferAspect);
-        destRect.x = (windowWidth - destRect.w) / 2;
-        destRect.y = 0;
+        CloseRom();
+        rom.error = "Invalid ROM file header";
+        return false;
     }
-    else
+
+    // Size the table to at least twice the image count so probes stay short
+    int numImages = data[4];
+    Uint32 indexSize = 16;
+    while (indexSize < (Uint32)numImages * 2)
+        indexSize *= 2;
+    rom.index = (RomImage *)calloc(indexSize, sizeof(RomImage));
+    if (!rom.index)
     {
-        destRect.w = windowWidth;
-        destRect.h = (int)(windowWidth / bufferAspect);
-        destRect.x = 0;
-        destRect.y = (windowHeight - destRect.h) / 2;
+        CloseRom();
+        rom.error = "Failed to allocate memory for ROM index";
+        return false;
     }
+    rom.indexMask = indexSize - 1;
 
-    // Render the texture
-    SDL_RenderCopy(renderer, texture, NULL, &destRect);
+    size_t offset = 5;
+    for (int i = 0; i < numImages; ++i)
+    {
+        if (size - offset < 16)
+        {
+            LOG("ROM file is truncated after %d images\n", i);
+            break;
+        }
+        const Uint8 *entry = data + offset;
+        unsigned int numPixelsInImage = ReadRomUint32(entry);
+        char imgName[5] = {0};
+        memcpy(imgName, entry + 4, 4);
+        offset += 16;
+        if ((size - offset) / sizeof(Uint16) < numPixelsInImage)
+        {
+            LOG("ROM file is truncated after %d images\n", i);
+            break;
+        }
 
-    // Present the renderer
-    SDL_RenderPresent(renderer);
+        // Keep the first image with a given id, the same one a linear scan would find
+        Uint32 id = RomImageId(imgName);
+        Uint32 slot = HashRomImageId(id) & rom.indexMask;
+        while (rom.index[slot].used && rom.index[slot].id != id)
+            slot = (slot + 1) & rom.indexMask;
+        if (!rom.index[slot].used)
+        {
+            RomImage *image = &rom.index[slot];
+            image->used = true;
+            image->id = id;
+            image->numPixels = numPixelsInImage;
+            image->width = ReadRomUint32(entry + 8);
+            image->height = ReadRomUint32(entry + 12);
+            image->pixels = data + offset;
+            rom.imageCount++;
+        }
+        offset += (size_t)numPixelsInImage * sizeof(Uint16);
+    }
+    return true;
 }
 
-// Implement Lua functions here
+void CloseRom()
+{
+    EvictTextures(0);
+    if (rom.data)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile((LPCVOID)rom.data);
+#else
+        munmap((void *)rom.data, rom.size);
+#endif
+    }
+    free(rom.index);
+    rom.data = NULL;
+    rom.size = 0;
+    rom.index = NULL;
+    rom.imageCount = 0;
+}
 
-int color_rgb(lua_State *L)
+RomImage *FindRomImage(const char *name)
 {
-    int r = luaL_checkinteger(L, 1);
-    int g = luaL_checkinteger(L, 2);
-    int b = luaL_checkinteger(L, 3);
+    return FindRomImageById(RomImageId(name));
+}
 
-    if (r < 0 || r > 7 || g < 0 || g > 7 || b < 0 || b > 7)
+RomImage *FindRomImageById(Uint32 id)
+{
+    if (!rom.index)
+        return NULL;
+
+    Uint32 slot = HashRomImageId(id) & rom.indexMask;
+    while (rom.index[slot].used)
     {
-        return luaL_error(L, "RGB values must be between 0 and 7");
+        if (rom.index[slot].id == id)
+            return &rom.index[slot];
+        slot = (slot + 1) & rom.indexMask;
     }
-
-    int encodedValue = EncodeColor(r, g, b);
-    lua_pushinteger(L, encodedValue);
-    return 1;
+    return NULL;
 }
 
-int color_hsv(lua_State *L)
+// Convert an image's palette indices to packed pixels, reading them straight from the mapping
+void DecodeRomImage(const RomImage *image, Uint32 *dest)
 {
-    int h = luaL_checkinteger(L, 1);
-    int s = luaL_checkinteger(L, 2);
-    int v = luaL_checkinteger(L, 3);
-    if (h < 0 || h > 7 || s < 0 || s > 7 || v < 0 || v > 7)
+    const Uint8 *src = image->pixels;
+    for (unsigned int i = 0; i < image->numPixels; ++i)
     {
-        return luaL_error(L, "HSV values must be between 0 and 7");
+        dest[i] = TexturePixel(src[0] | (src[1] << 8));
+        src += 2;
     }
+}
 
-    float hue = h / 7.0f * 360.0f;
-    float saturation = s / 7.0f;
-    float value = v / 7.0f;
+size_t TextureBytes(const Texture *tex)
+{
+    return sizeof(Texture) + (size_t)tex->width * tex->height * sizeof(Uint32);
+}
 
-    float c = value * saturation;
-    float x = c * (1 - fabsf(fmodf(hue / 60.0f, 2) - 1));
-    float m = value - c;
-
-    float r_prime, g_prime, b_prime;
-
-    if (hue < 60)
-    {
-        r_prime = c;
-        g_prime = x;
-        b_prime = 0;
-    }
-    else if (hue < 120)
-    {
-        r_prime = x;
-        g_prime = c;
-        b_prime = 0;
-    }
-    else if (hue < 180)
-    {
-        r_prime = 0;
-        g_prime = c;
-        b_prime = x;
-    }
-    else if (hue < 240)
-    {
-        r_prime = 0;
-        g_prime = x;
-        b_prime = c;
-    }
-    else if (hue < 300)
-    {
-        r_prime = x;
-        g_prime = 0;
-        b_prime = c;
-    }
+static void UnlinkCachedTexture(RomImage *image)
+{
+    if (image->lruPrev)
+        image->lruPrev->lruNext = image->lruNext;
     else
-    {
-        r_prime = c;
-        g_prime = 0;
-        b_prime = x;
-    }
-
-    int r = (int)((r_prime + m) * 7 + 0.5f); // Added 0.5f for rounding
-    int g = (int)((g_prime + m) * 7 + 0.5f);
-    int b = (int)((b_prime + m) * 7 + 0.5f);
-
-    // Clamp values to [0,7]
-    if (r > 7)
-        r = 7;
-    if (g > 7)
-        g = 7;
-    if (b > 7)
-        b = 7;
-
-    int encodedValue = EncodeColor(r, g, b);
-    lua_pushinteger(L, encodedValue);
-    return 1;
+        textureCache.lruHead = image->lruNext;
+    if (image->lruNext)
+        image->lruNext->lruPrev = image->lruPrev;
+    else
+        textureCache.lruTail = image->lruPrev;
+    image->lruPrev = NULL;
+    image->lruNext = NULL;
 }
 
-int color_greyscale(lua_State *L)
+static void LinkCachedTexture(RomImage *image)
 {
-    Uint32 encodedColor = luaL_checkinteger(L, 1);
-    // Decode the color to get the mapped Uint32 color
-    Uint32 mappedColor = DecodeColor(encodedColor);
-
-    // Extract r, g, b components using SDL_GetRGBA
-    Uint8 r, g, b, a;
-    SDL_GetRGBA(mappedColor, globalFormat, &r, &g, &b, &a);
-
-    // Calculate the grayscale value
-    Uint8 gray = (Uint8)(((int)r + (int)g + (int)b) / 3);
-    int grayIndex = gray * 7 / 255; // Map 0-255 to 0-7
-    if (grayIndex > 7)
-        grayIndex = 7;
-
-    // Encode the grayscale color
-    int greyscaleColor = EncodeColor(grayIndex, grayIndex, grayIndex);
-    lua_pushinteger(L, greyscaleColor);
-    return 1;
+    image->lruPrev = NULL;
+    image->lruNext = textureCache.lruHead;
+    if (textureCache.lruHead)
+        textureCache.lruHead->lruPrev = image;
+    else
+        textureCache.lruTail = image;
+    textureCache.lruHead = image;
 }
 
-int texture_fromShader(lua_State *L)
+void TouchCachedTexture(RomImage *image)
 {
-    luaL_checktype(L, 1, LUA_TFUNCTION);
-    int width = luaL_checkinteger(L, 2);
-    int height = luaL_checkinteger(L, 3);
-
-    lua_newtable(L);
-    for (int y = 0; y < height; y++)
-    {
-        lua_newtable(L);
-        for (int x = 0; x < width; x++)
-        {
-            lua_pushvalue(L, 1); // Push the shader function
-            lua_pushinteger(L, x);
-            lua_pushinteger(L, y);
-            if (lua_pcall(L, 2, 1, 0) != LUA_OK)
-            {
-                LOG("Error in Shader: %s\n", lua_tostring(L, -1));
-                lua_pop(L, 1);
-                lua_pushinteger(L, EncodeColor(0, 0, 0)); // default color if error
-            }
-            int value = lua_tointeger(L, -1);
-            lua_pop(L, 1);
-            lua_pushinteger(L, value);
-            lua_rawseti(L, -2, x + 1);
-        }
-        lua_rawseti(L, -2, y + 1);
-    }
-    return 1;
+    if (textureCache.lruHead == image)
+        return;
+    UnlinkCachedTexture(image);
+    LinkCachedTexture(image);
 }
 
-int texture_fromRom(lua_State *L)
+// Drop least recently used textures until the cache fits the budget, handles in Lua keep theirs alive
+void EvictTextures(size_t budget)
 {
-    const char *imageName = luaL_checkstring(L, 1);
-
-    if (strlen(romPathGlobal) == 0)
+    while (textureCache.lruTail && textureCache.residentBytes > budget)
     {
-        return luaL_error(L, "ROM path not provided.");
+        RomImage *image = textureCache.lruTail;
+        UnlinkCachedTexture(image);
+        textureCache.residentBytes -= TextureBytes(image->cached);
+        textureCache.entries--;
+        textureCache.evictions++;
+        ReleaseTexture(image->cached);
+        image->cached = NULL;
     }
+}
 
-    FILE *file = fopen(romPathGlobal, "rb");
-    if (!file)
-    {
-        return luaL_error(L, "Failed to open ROM file: %s", romPathGlobal);
-    }
+// The cache takes its own reference, textures bigger than the whole budget are never kept
+void CacheRomTexture(RomImage *image, Texture *tex)
+{
+    size_t bytes = TextureBytes(tex);
+    if (bytes > textureCache.budget)
+        return;
+
+    EvictTextures(textureCache.budget - bytes);
+    RetainTexture(tex);
+    tex->shared = true;
+    image->cached = tex;
+    LinkCachedTexture(image);
+    textureCache.residentBytes += bytes;
+    textureCache.entries++;
+}
 
-    char header[4];
-    fread(header, 1, 4, file);
-    if (strncmp(header, "imag", 4) != 0)
-    {
-        fclose(file);
-        return luaL_error(L, "Invalid ROM file header");
-    }
+// Total workers including the main thread, the 'threads' global caps it
+int WorkerCount()
+{
+    return workerPool.threadCount + 1;
+}
 
-    unsigned char numImages;
-    fread(&numImages, 1, 1, file);
+static int WorkerThread(void *data)
+{
+    int worker = (int)(intptr_t)data;
+    int seenGeneration = 0;
 
-    unsigned int width, height;
-    Uint16 *tempPixels = NULL;
-    bool found = false;
-    for (int i = 0; i < numImages; ++i)
+    SDL_LockMutex(workerPool.lock);
+    while (true)
     {
-        unsigned int numPixelsInImage;
-        char imgName[5] = {0};
-        fread(&numPixelsInImage, 4, 1, file);
-        fread(imgName, 4, 1, file);
-        fread(&width, 4, 1, file);
-        fread(&height, 4, 1, file);
-
-        if (strncmp(imgName, imageName, 4) == 0)
-        {
-            if (numPixelsInImage != width * height)
-            {
-                fclose(file);
-                return luaL_error(L, "Image size does not match expected dimensions");
-            }
+        while (workerPool.generation == seenGeneration && !workerPool.quitting)
+            SDL_CondWait(workerPool.wake, workerPool.lock);
+        if (workerPool.quitting)
+            break;
+        seenGeneration = workerPool.generation;
+        SDL_UnlockMutex(workerPool.lock);
 
-            if (numPixelsInImage > 1000000)
-            {
-                fclose(file);
-                return luaL_error(L, "Image too large to load");
-            }
+        int job;
+        while ((job = SDL_AtomicAdd(&workerPool.nextJob, 1)) < workerPool.jobCount)
+            workerPool.function(workerPool.context, job, worker);
 
-            tempPixels = (Uint16 *)malloc(numPixelsInImage * sizeof(Uint16));
-            if (!tempPixels)
-            {
-                fclose(file);
-                return luaL_error(L, "Failed to allocate memory for image data");
-            }
-            fread(tempPixels, sizeof(Uint16), numPixelsInImage, file);
-            found = true;
-            break;
-        }
-        else
-        {
-            fseek(file, numPixelsInImage * sizeof(Uint16), SEEK_CUR);
-        }
+        SDL_LockMutex(workerPool.lock);
+        if (--workerPool.pending == 0)
+            SDL_CondSignal(workerPool.done);
     }
+    SDL_UnlockMutex(workerPool.lock);
+    return 0;
+}
 
-    fclose(file);
+// Threads are only started the first time something wants to run in parallel
+void StartWorkerPool()
+{
+    if (workerPool.lock)
+        return;
 
-    if (!found)
+    int workers = SDL_GetCPUCount();
+    lua_getglobal(L, "threads");
+    if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0)
+        workers = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (workers > 64)
+        workers = 64;
+
+    workerPool.lock = SDL_CreateMutex();
+    workerPool.wake = SDL_CreateCond();
+    workerPool.done = SDL_CreateCond();
+    workerPool.threads = (SDL_Thread **)calloc(workers, sizeof(SDL_Thread *));
+    workerPool.threadCount = 0;
+    if (!workerPool.lock || !workerPool.wake || !workerPool.done || !workerPool.threads)
     {
-        return luaL_error(L, "Image '%s' not found in ROM file", imageName);
+        LOG("Failed to create worker pool: %s\n", SDL_GetError());
+        return;
     }
 
-    lua_newtable(L);
-    for (unsigned int y = 0; y < height; ++y)
+    for (int i = 1; i < workers; i++)
     {
-        lua_newtable(L);
-        for (unsigned int x = 0; x < width; ++x)
+        SDL_Thread *thread = SDL_CreateThread(WorkerThread, "plf worker", (void *)(intptr_t)i);
+        if (!thread)
         {
-            unsigned int index = y * width + x;
-            int color = tempPixels[index];
-
-            lua_pushinteger(L, color);
-            lua_rawseti(L, -2, x + 1);
+            LOG("Failed to create worker thread: %s\n", SDL_GetError());
+            break;
         }
-        lua_rawseti(L, -2, y + 1);
+        workerPool.threads[workerPool.threadCount++] = thread;
     }
-
-    free(tempPixels);
-    return 1;
 }
 
-int drawing_shader(lua_State *L)
+void StopWorkerPool()
 {
-    luaL_checktype(L, 1, LUA_TFUNCTION);
+    if (!workerPool.lock)
+        return;
+
+    SDL_LockMutex(workerPool.lock);
+    workerPool.quitting = true;
+    SDL_CondBroadcast(workerPool.wake);
+    SDL_UnlockMutex(workerPool.lock);
+    for (int i = 0; i < workerPool.threadCount; i++)
+        SDL_WaitThread(workerPool.threads[i], NULL);
+
+    free(workerPool.threads);
+    SDL_DestroyCond(workerPool.done);
+    SDL_DestroyCond(workerPool.wake);
+    SDL_DestroyMutex(workerPool.lock);
+    memset(&workerPool, 0, sizeof(workerPool));
+}
 
-    for (int y = 0; y < bufferHeight; y++)
+// Run jobs 0 to jobCount - 1 across the pool and wait for all of them to finish
+void RunJobs(JobFunction function, void *context, int jobCount)
+{
+    StartWorkerPool();
+    if (workerPool.threadCount == 0)
     {
-        for (int x = 0; x < bufferWidth; x++)
-        {
-            lua_pushvalue(L, 1);   // Push the shader function
-            lua_pushinteger(L, x); // Push x
-            lua_pushinteger(L, y); // Push y
-            if (lua_pcall(L, 2, 1, 0) != LUA_OK)
-            {
-                LOG("Error in Shader: %s\n", lua_tostring(L, -1));
-                lua_pop(L, 1);
-                // Set default color as black with full opacity
-                pixelsBack[y * bufferWidth + x] = (0 << 24) | (0 << 16) | (0 << 8) | 255;
-                continue;
-            }
-            int value = lua_tointeger(L, -1);
-            lua_pop(L, 1);
-
-            if (value < 1 || value > 512)
-            {
-                // Set default color as black with full opacity
-                pixelsBack[y * bufferWidth + x] = (0 << 24) | (0 << 16) | (0 << 8) | 255;
-                continue;
-            }
-
-            // Decode the color
-            Uint32 mappedColor = DecodeColor(value);
-            Uint8 r, g, b, a;
-            SDL_GetRGBA(mappedColor, globalFormat, &r, &g, &b, &a);
-
-            // Write the decoded color to the back buffer
-            pixelsBack[y * bufferWidth + x] = (r << 24) | (g << 16) | (b << 8) | a; // RGBA
-        }
+        for (int job = 0; job < jobCount; job++)
+            function(context, job, 0);
+        return;
     }
 
-    return 0;
+    SDL_LockMutex(workerPool.lock);
+    workerPool.function = function;
+    workerPool.context = context;
+    workerPool.jobCount = jobCount;
+    SDL_AtomicSet(&workerPool.nextJob, 0);
+    workerPool.pending = workerPool.threadCount;
+    workerPool.generation++;
+    SDL_CondBroadcast(workerPool.wake);
+    SDL_UnlockMutex(workerPool.lock);
+
+    int job;
+    while ((job = SDL_AtomicAdd(&workerPool.nextJob, 1)) < jobCount)
+        function(context, job, 0);
+
+    SDL_LockMutex(workerPool.lock);
+    while (workerPool.pending > 0)
+        SDL_CondWait(workerPool.done, workerPool.lock);
+    SDL_UnlockMutex(workerPool.lock);
 }
 
-int drawing_rect(lua_State *L)
+static int LoaderThread(void *data)
 {
-    luaL_checktype(L, 1, LUA_TTABLE);
-    int xOffset = luaL_checkinteger(L, 2);
-    int yOffset = luaL_checkinteger(L, 3);
-
-    int textureHeight = lua_objlen(L, 1); // Updated to lua_objlen
-
-    for (int y = 1; y <= textureHeight; y++)
+    (void)data;
+    SDL_LockMutex(loader.lock);
+    while (true)
     {
-        lua_rawgeti(L, 1, y);
-        int textureWidth = lua_objlen(L, -1); // Updated to lua_objlen
+        while (!loader.head && !loader.quitting)
+            SDL_CondWait(loader.wake, loader.lock);
+        if (loader.quitting)
+            break;
 
-        for (int x = 1; x <= textureWidth; x++)
+        // Images are taken one at a time so a request queued later doesn't wait for all of a big one
+        LoadRequest *request = loader.head;
+        LoadItem *item = &request->items[request->nextItem++];
+        if (request->nextItem == request->count)
         {
-            lua_rawgeti(L, -1, x);
-            int value = lua_tointeger(L, -1);
-            lua_pop(L, 1);
-
-            int destX = xOffset + x - 1;
-            int destY = yOffset + y - 1;
-
-            if (destX >= 0 && destX < bufferWidth && destY >= 0 && destY < bufferHeight)
-            {
-                if (value <= 0 || value > 512)
-                    continue;
-
-                // Decode the color
-                Uint32 mappedColor = DecodeColor(value);
-                Uint8 r, g, b, a;
-                SDL_GetRGBA(mappedColor, globalFormat, &r, &g, &b, &a);
-
-                // Write to the back buffer
-                pixelsBack[destY * bufferWidth + destX] = (r << 24) | (g << 16) | (b << 8) | a; // RGBA
-            }
+            loader.head = request->next;
+            if (!loader.head)
+                loader.tail = NULL;
+            request->queued = false;
         }
-        lua_pop(L, 1);
+        if (item->ready)
+            continue;
+        loader.current = request;
+        SDL_UnlockMutex(loader.lock);
+
+        // The pages of the mapped ROM are faulted in here instead of on the Lua thread
+        Texture *tex = AllocTexture(item->image->width, item->image->height);
+        if (tex)
+        {
+            DecodeRomImage(item->image, tex->pixels);
+            UpdateTextureOpacity(tex);
+        }
+
+        SDL_LockMutex(loader.lock);
+        item->texture = tex;
+        item->error = tex ? NULL : "Failed to allocate memory for texture";
+        item->ready = true;
+        request->remaining--;
+        loader.current = NULL;
+        SDL_CondBroadcast(loader.finished);
     }
+    SDL_UnlockMutex(loader.lock);
     return 0;
 }
 
-int drawing_circle(lua_State *L)
+// Started the first time a script loads something in the background
+bool StartAssetLoader()
 {
-    int centerX = luaL_checkinteger(L, 1);
-    int centerY = luaL_checkinteger(L, 2);
-    int radius = luaL_checkinteger(L, 3);
-    int color = luaL_checkinteger(L, 4);
-
-    // Decode the color
-    Uint32 mappedColor = DecodeColor(color);
-    Uint8 r, g, b, a;
-    SDL_GetRGBA(mappedColor, globalFormat, &r, &g, &b, &a);
-
-    for (int y = -radius; y <= radius; y++)
+    if (loader.thread)
+        return true;
+
+    loader.lock = SDL_CreateMutex();
+    loader.wake = SDL_CreateCond();
+    loader.finished = SDL_CreateCond();
+    if (loader.lock && loader.wake && loader.finished)
+        loader.thread = SDL_CreateThread(LoaderThread, "plf loader", NULL);
+    if (!loader.thread)
     {
-        for (int x = -radius; x <= radius; x++)
-        {
-            if (x * x + y * y <= radius * radius)
-            {
-                int destX = centerX + x;
-                int destY = centerY + y;
-                if (destX >= 0 && destX < bufferWidth && destY >= 0 && destY < bufferHeight)
-                {
-                    // Write to the back buffer
-                    pixelsBack[destY * bufferWidth + destX] = (r << 24) | (g << 16) | (b << 8) | a; // RGBA
-                }
-            }
-        }
+        LOG("Failed to create the loader thread: %s\n", SDL_GetError());
+        StopAssetLoader();
+        return false;
     }
-
-    return 0;
+    return true;
 }
 
-int drawing_line(lua_State *L)
+// Images not decoded yet stay that way, their handles can still be freed afterwards
+void StopAssetLoader()
 {
-    int x1 = luaL_checkinteger(L, 1);
-    int y1 = luaL_checkinteger(L, 2);
-    int x2 = luaL_checkinteger(L, 3);
-    int y2 = luaL_checkinteger(L, 4);
-    int color = luaL_checkinteger(L, 5);
-
-    // Decode the color
-    Uint32 mappedColor = DecodeColor(color);
-    Uint8 r, g, b, a;
-    SDL_GetRGBA(mappedColor, globalFormat, &r, &g, &b, &a);
-
-    int dx = abs(x2 - x1);
-    int dy = abs(y2 - y1);
-    int sx = x1 < x2 ? 1 : -1;
-    int sy = y1 < y2 ? 1 : -1;
-    int err = dx - dy;
-
-    while (true)
+    if (loader.thread)
     {
-        if (x1 >= 0 && x1 < bufferWidth && y1 >= 0 && y1 < bufferHeight)
-        {
-            // Write to the back buffer
-            pixelsBack[y1 * bufferWidth + x1] = (r << 24) | (g << 16) | (b << 8) | a; // RGBA
-        }
-        if (x1 == x2 && y1 == y2)
-            break;
-        int e2 = 2 * err;
-        if (e2 > -dy)
-        {
-            err -= dy;
-            x1 += sx;
-        }
-        if (e2 < dx)
-        {
-            err += dx;
-            y1 += sy;
-        }
+        SDL_LockMutex(loader.lock);
+        loader.quitting = true;
+        SDL_CondBroadcast(loader.wake);
+        SDL_UnlockMutex(loader.lock);
+        SDL_WaitThread(loader.thread, NULL);
     }
-
-    return 0;
+    for (LoadRequest *request = loader.head; request; request = request->next)
+        request->queued = false;
+    if (loader.finished)
+        SDL_DestroyCond(loader.finished);
+    if (loader.wake)
+        SDL_DestroyCond(loader.wake);
+    if (loader.lock)
+        SDL_DestroyMutex(loader.lock);
+    memset(&loader, 0, sizeof(loader));
 }
 
-int drawing_pixel(lua_State *L)
+// Initialize Lua and register functions
+void InitializeLua(const char *scriptPath)
 {
-    int x = luaL_checkinteger(L, 1);
-    int y = luaL_checkinteger(L, 2);
-    int color = luaL_checkinteger(L, 3);
+    L = luaL_newstate();
+    luaL_openlibs(L);
 
-    if (x >= 0 && x < bufferWidth && y >= 0 && y < bufferHeight)
-    {
-        // Decode the color
-        Uint32 mappedColor = DecodeColor(color);
-        Uint8 r, g, b, a;
-        SDL_GetRGBA(mappedColor, globalFormat, &r, &g, &b, &a);
+    // Frame stats go in the standard debug library
+    lua_getglobal(L, "debug");
+    lua_pushcfunction(L, debug_stats);
+    lua_setfield(L, -2, "stats");
+    lua_pushcfunction(L, debug_overlay);
+    lua_setfield(L, -2, "overlay");
+    lua_pop(L, 1);
 
-        // Write to the back buffer
-        pixelsBack[y * bufferWidth + x] = (r << 24) | (g << 16) | (b << 8) | a; // RGBA
+    // Register color library
+    RegisterColorLibrary(L);
+
+    // Register drawing library
+    luaL_Reg drawingLib[] = {
+        {"shader", drawing_shader},
+        {"rect", drawing_rect},
+        {"sprite", drawing_sprite},
+        {"circle", drawing_circle},
+        {"line", drawing_line},
+        {"pixel", drawing_pixel},
+        {"fillRect", drawing_fillRect},
+        {"simd", drawing_simd},
+        {"shaderStats", drawing_shaderStats},
+        {"buffer", drawing_buffer},
+        {"palette", drawing_palette},
+        {"batch", drawing_batch},
+        {"newBatch", drawing_newBatch},
+        {"deferred", drawing_deferred},
+        {"flush", drawing_flush},
+        {"persistent", drawing_persistent},
+        {"clear", drawing_clear},
+        {"target", drawing_target},
+        {NULL, NULL}};
+    luaL_newlib(L, drawingLib);
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, BATCH_PIXEL);
+    lua_setfield(L, -2, "pixel");
+    lua_pushinteger(L, BATCH_LINE);
+    lua_setfield(L, -2, "line");
+    lua_pushinteger(L, BATCH_CIRCLE);
+    lua_setfield(L, -2, "circle");
+    lua_pushinteger(L, BATCH_FILL_RECT);
+    lua_setfield(L, -2, "fillRect");
+    lua_setfield(L, -2, "ops");
+    lua_setglobal(L, "drawing");
+
+    // Register texture library
+    luaL_Reg textureLib[] = {
+        {"fromShader", texture_fromShader},
+        {"fromRom", texture_fromRom},
+        {"loadAsync", texture_loadAsync},
+        {"fromTable", texture_fromTable},
+        {"cacheStats", texture_cacheStats},
+        {"cacheBudget", texture_cacheBudget},
+        {"atlas", texture_atlas},
+        {NULL, NULL}};
+    luaL_newlib(L, textureLib);
+    lua_setglobal(L, "texture");
+
+    // Register command buffer methods
+    luaL_Reg batchMethods[] = {
+        {"pointer", batch_pointer},
+        {"capacity", batch_capacity},
+        {"set", batch_set},
+        {NULL, NULL}};
+    luaL_newmetatable(L, BATCH_METATABLE);
+    luaL_newlib(L, batchMethods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    // Register background load methods
+    luaL_Reg loadMethods[] = {
+        {"poll", load_poll},
+        {"wait", load_wait},
+        {"get", load_get},
+        {NULL, NULL}};
+    luaL_newmetatable(L, LOAD_METATABLE);
+    luaL_newlib(L, loadMethods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, load_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // Register atlas methods
+    luaL_Reg atlasMethods[] = {
+        {"texture", atlas_texture},
+        {"rect", atlas_rect},
+        {NULL, NULL}};
+    luaL_newmetatable(L, ATLAS_METATABLE);
+    luaL_newlib(L, atlasMethods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, atlas_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // Register texture object methods
+    luaL_Reg textureMethods[] = {
+        {"width", texture_width},
+        {"height", texture_height},
+        {"get", texture_get},
+        {"set", texture_set},
+        {"copy", texture_copy},
+        {"stats", texture_stats},
+        {NULL, NULL}};
+    luaL_newmetatable(L, TEXTURE_METATABLE);
+    luaL_newlib(L, textureMethods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, texture_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // Register mouse library
+    luaL_Reg mouseLib[] = {
+        {"position", mouse_position},
+        {"down", mouse_down},
+        {"visible", mouse_visible},
+        {"center", mouse_center},
+        {NULL, NULL}};
+    luaL_newlib(L, mouseLib);
+    lua_setglobal(L, "mouse");
+
+    // Register keyboard library
+    luaL_Reg keyboardLib[] = {
+        {"down", keyboard_down},
+        {NULL, NULL}};
+    luaL_newlib(L, keyboardLib);
+    PushKeyTable(L);
+    lua_setfield(L, -2, "keys");
+    lua_setglobal(L, "keyboard");
+
+    // Register profiler library
+    luaL_Reg profilerLib[] = {
+        {"start", profiler_start},
+        {"stop", profiler_stop},
+        {"running", profiler_running},
+        {"report", profiler_report},
+        {"save", profiler_save},
+        {NULL, NULL}};
+    luaL_newlib(L, profilerLib);
+    lua_setglobal(L, "profiler");
+
+    // Register trace library
+    luaL_Reg traceLib[] = {
+        {"start", trace_start},
+        {"stop", trace_stop},
+        {"recording", trace_recording},
+        {"begin", trace_begin},
+        {"finish", trace_finish},
+        {"save", trace_save},
+        {NULL, NULL}};
+    luaL_newlib(L, traceLib);
+    lua_setglobal(L, "trace");
+
+    // Register input library
+    luaL_Reg inputLib[] = {
+        {"snapshot", input_snapshot},
+        {NULL, NULL}};
+    luaL_newlib(L, inputLib);
+    lua_setglobal(L, "input");
+
+    // Register window library
+    luaL_Reg windowLib[] = {
+        {"title", window_title},
+        {"close", window_close},
+        {"fullscreen", window_fullscreen},
+        {"message", window_message},
+        {"frameStats", window_frameStats},
+        {NULL, NULL}};
+    luaL_newlib(L, windowLib);
+    lua_setglobal(L, "window");
+
+    // Register util library
+    RegisterUtilLibrary(L);
+
+    // Load and execute the Lua script
+    if (luaL_dofile(L, scriptPath))
+    {
+        LOG("Lua Error: %s\n", lua_tostring(L, -1));
+        lua_close(L);
+        L = NULL;
+        return;
+    }
+
+    // Keep hold of events so each frame doesn't have to look it up
+    lua_getglobal(L, "events");
+    if (lua_isfunction(L, -1))
+    {
+        eventQueue.callbackRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_newtable(L);
+        eventQueue.listRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_newtable(L);
+        eventQueue.poolRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    else
+    {
+        lua_pop(L, 1);
+    }
+}
+
+// Also opened in the parallel shader worker states
+void RegisterColorLibrary(lua_State *L)
+{
+    luaL_Reg colorLib[] = {
+        {"rgb", color_rgb},
+        {"hsv", color_hsv},
+        {"greyscale", color_greyscale},
+        {NULL, NULL}};
+    luaL_newlib(L, colorLib);
+    lua_setglobal(L, "color");
+}
+
+void RegisterUtilLibrary(lua_State *L)
+{
+    luaL_Reg utilLib[] = {
+        {"distance", util_distance},
+        {"clamp", util_clamp},
+        {"lerp", util_lerp},
+        {"random", util_random},
+        {"httpGet", http_get},
+        {"intersect", util_intersect},
+        {NULL, NULL}};
+    luaL_newlib(L, utilLib);
+    lua_setglobal(L, "util");
+}
+
+void SetupBuffers(int width, int height)
+{
+    bufferWidth = width;
+    bufferHeight = height;
+    bufferStride = width;
+
+    // Allocate double pixel buffers, the locked texture takes their place when rendering into it
+    if (!lockedRendering)
+    {
+        pixelsFront = (Uint32 *)malloc(bufferWidth * bufferHeight * sizeof(Uint32));
+        pixelsBack = (Uint32 *)malloc(bufferWidth * bufferHeight * sizeof(Uint32));
+        if (!pixelsFront || !pixelsBack)
+        {
+            LOG("Failed to allocate pixel buffers.\n");
+            exit(1);
+        }
+        memset(pixelsFront, 0, bufferWidth * bufferHeight * sizeof(Uint32));
+        memset(pixelsBack, 0, bufferWidth * bufferHeight * sizeof(Uint32));
+    }
+
+    if (headless)
+        return;
+
+    // Create texture with matching pixel format, its contents start out unknown so the first upload is full
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, bufferWidth, bufferHeight);
+    if (!texture)
+    {
+        LOG("Failed to create texture: %s\n", SDL_GetError());
+        free(pixelsFront);
+        free(pixelsBack);
+        exit(1);
+    }
+    DirtyRect all = {0, 0, bufferWidth - 1, bufferHeight - 1};
+    dirtyUploaded = all;
+}
+
+// Point pixelsBack at the streaming texture for this frame. Locked memory starts out undefined, so all of it is cleared
+void LockBackBuffer()
+{
+    if (!lockedRendering)
+        return;
+
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0)
+    {
+        LOG("Failed to lock texture, going back to buffers: %s\n", SDL_GetError());
+        if (!StopLockedRendering())
+            exit(1);
+        return;
+    }
+    textureLocked = true;
+    pixelsBack = (Uint32 *)pixels;
+    bufferStride = pitch / (int)sizeof(Uint32);
+
+    if (bufferStride == bufferWidth)
+    {
+        memset(pixelsBack, 0, (size_t)bufferWidth * bufferHeight * sizeof(Uint32));
+    }
+    else
+    {
+        for (int y = 0; y < bufferHeight; y++)
+            memset(pixelsBack + y * bufferStride, 0, bufferWidth * sizeof(Uint32));
+    }
+    dirtyBack.minX = dirtyBack.minY = 0;
+    dirtyBack.maxX = dirtyBack.maxY = -1;
+}
+
+void UnlockBackBuffer()
+{
+    if (!textureLocked)
+        return;
+    SDL_UnlockTexture(texture);
+    textureLocked = false;
+}
+
+// Go back to the front and back buffers, keeping what was already drawn this frame
+bool StopLockedRendering()
+{
+    if (!lockedRendering)
+        return true;
+
+    Uint32 *front = (Uint32 *)calloc((size_t)bufferWidth * bufferHeight, sizeof(Uint32));
+    Uint32 *back = (Uint32 *)calloc((size_t)bufferWidth * bufferHeight, sizeof(Uint32));
+    if (!front || !back)
+    {
+        LOG("Failed to allocate pixel buffers.\n");
+        free(front);
+        free(back);
+        return false;
+    }
+    if (textureLocked)
+    {
+        for (int y = 0; y < bufferHeight; y++)
+            memcpy(back + y * bufferWidth, pixelsBack + y * bufferStride, bufferWidth * sizeof(Uint32));
+        UnlockBackBuffer();
+    }
+
+    pixelsFront = front;
+    pixelsBack = back;
+    bufferStride = bufferWidth;
+    lockedRendering = false;
+    MarkAllDirty();
+    DirtyRect all = {0, 0, bufferWidth - 1, bufferHeight - 1};
+    dirtyUploaded = all;
+    return true;
+}
+
+// Everything after update that gets the frame ready to show: the target is let go, the deferred queue drawn
+// and the buffers swapped (or the locked texture unlocked, or the frame handed to the main thread)
+void FinishFrame()
+{
+    if (drawTarget)
+    {
+        UpdateTextureOpacity(drawTarget);
+        ReleaseTexture(drawTarget);
+        drawTarget = NULL;
+    }
+    FlushDeferred();
+    if (frameStats.overlay)
+        DrawStatsOverlay();
+
+    if (pipelined)
+    {
+        // The main thread takes it from here
+        SubmitFrame();
+    }
+    else if (lockedRendering)
+    {
+        // The frame is already in the texture
+        UnlockBackBuffer();
+    }
+    else if (persistentCanvas)
+    {
+        // Nothing to swap or clear, the back buffer is uploaded as it is
+        if (backBufferPinned)
+            MarkAllDirty();
+    }
+    else
+    {
+        // Swap front and back buffers, or copy when a script holds on to the back buffer
+        if (backBufferPinned)
+        {
+            MarkAllDirty(); // Writes through the pointer aren't tracked
+            memcpy(pixelsFront, pixelsBack, bufferWidth * bufferHeight * sizeof(Uint32));
+            dirtyFront = dirtyBack;
+        }
+        else
+        {
+            Uint32 *temp = pixelsFront;
+            pixelsFront = pixelsBack;
+            pixelsBack = temp;
+            DirtyRect tempDirty = dirtyFront;
+            dirtyFront = dirtyBack;
+            dirtyBack = tempDirty;
+        }
+
+        // Clear what was drawn into the back buffer last time it was used
+        ClearDirty(pixelsBack, &dirtyBack);
+    }
+}
+
+// Update pixels by calling Lua's update function with deltaTime
+void UpdatePixelsFromLua(double deltaTime, double alpha)
+{
+    lua_getglobal(L, "update");
+    if (lua_isfunction(L, -1))
+    {
+        lua_pushnumber(L, deltaTime);
+        lua_pushnumber(L, alpha); // How far between the last two fixedUpdate calls this frame is
+
+        if (lua_pcall(L, 2, 0, 0) != LUA_OK)
+        {
+            LOG("Lua Error in 'update': %s\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    else
+    {
+        lua_pop(L, 1);
+        LOG("Lua 'update' function not found.\n"); // Debug print
+    }
+}
+
+// Call fixedUpdate(step) once for every whole step of time that has passed, when tickRate is set.
+// Returns the leftover as a fraction of a step, for interpolating between the last two states
+double RunFixedUpdates(double deltaTime)
+{
+    lua_getglobal(L, "tickRate");
+    double rate = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    lua_getglobal(L, "fixedUpdate");
+    if (rate <= 0.0 || !lua_isfunction(L, -1))
+    {
+        lua_pop(L, 1);
+        pacer.accumulator = 0.0;
+        return 0.0;
+    }
+
+    double step = 1.0 / rate;
+    pacer.accumulator += deltaTime;
+    for (int steps = 0; pacer.accumulator >= step; steps++)
+    {
+        // Too far behind to catch up, drop the backlog instead of slowing down further
+        if (steps == MAX_FIXED_STEPS)
+        {
+            pacer.accumulator = fmod(pacer.accumulator, step);
+            break;
+        }
+        lua_pushvalue(L, -1);
+        lua_pushnumber(L, step);
+        if (lua_pcall(L, 1, 0, 0) != LUA_OK)
+        {
+            LOG("Lua Error in 'fixedUpdate': %s\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+        pacer.accumulator -= step;
+    }
+    lua_pop(L, 1);
+    return pacer.accumulator / step;
+}
+
+// Wait for the next frame's deadline, sleeping while it's far off and spinning for the last bit
+void PaceFrame(double period)
+{
+    if (period <= 0.0)
+    {
+        pacer.deadline = 0;
+        return;
+    }
+
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 ticks = (Uint64)(period * (double)frequency);
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (pacer.deadline == 0 || now >= pacer.deadline + ticks)
+    {
+        // First paced frame, or a whole frame behind: start the schedule again from now
+        pacer.deadline = now + ticks;
+        return;
+    }
+
+    while (now < pacer.deadline)
+    {
+        double remaining = (double)(pacer.deadline - now) / (double)frequency;
+        if (remaining > PACE_SPIN_SECONDS)
+            SDL_Delay((Uint32)((remaining - PACE_SPIN_SECONDS) * 1000.0));
+        now = SDL_GetPerformanceCounter();
+    }
+    pacer.deadline += ticks;
+}
+
+// Time since the last present, kept for window.frameStats
+void RecordFrameTime()
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (pacer.lastPresent != 0)
+    {
+        pacer.samples[pacer.nextSample] = (double)(now - pacer.lastPresent) / (double)SDL_GetPerformanceFrequency();
+        pacer.nextSample = (pacer.nextSample + 1) % FRAME_SAMPLES;
+        if (pacer.sampleCount < FRAME_SAMPLES)
+            pacer.sampleCount++;
+    }
+    pacer.lastPresent = now;
+}
+
+// Add the time since *mark to a phase of this frame and move the mark up to now
+void EndPhase(FramePhase phase, Uint64 *mark)
+{
+    static const char *phaseNames[PHASE_COUNT] = {"events", "update", "swap", "upload", "present", "pace"};
+    Uint64 now = SDL_GetPerformanceCounter();
+    frameStats.current.phases[phase] += (double)(now - *mark) / (double)SDL_GetPerformanceFrequency();
+    if (tracer.recording)
+        TraceZone(phaseNames[phase], "loop", TRACE_LOOP, *mark, now);
+    *mark = now;
+}
+
+// Close off this frame's numbers and start counting the next one
+void RecordFrameStats()
+{
+    FrameSample *sample = &frameStats.current;
+    sample->pixels += (Uint32)SDL_AtomicSet(&frameStats.tilePixels, 0);
+    sample->luaKilobytes = lua_gc(L, LUA_GCCOUNT, 0) + lua_gc(L, LUA_GCCOUNTB, 0) / 1024.0;
+
+    frameStats.samples[frameStats.nextSample] = *sample;
+    frameStats.nextSample = (frameStats.nextSample + 1) % FRAME_SAMPLES;
+    if (frameStats.sampleCount < FRAME_SAMPLES)
+        frameStats.sampleCount++;
+    memset(sample, 0, sizeof(*sample));
+}
+
+void RecordLatency(double seconds)
+{
+    frameStats.latencies[frameStats.nextLatency] = seconds;
+    frameStats.nextLatency = (frameStats.nextLatency + 1) % FRAME_SAMPLES;
+    if (frameStats.latencyCount < FRAME_SAMPLES)
+        frameStats.latencyCount++;
+}
+
+// 3x5 glyphs for the overlay, top row in the high bits
+static const Uint16 overlayDigits[10] = {0x7B6F, 0x2C97, 0x73E7, 0x73CF, 0x5BC9, 0x79CF, 0x79EF, 0x7249, 0x7BEF, 0x7BCF};
+static const Uint16 overlayLetters[26] = {0x2BED, 0x6BAE, 0x3923, 0x6B6E, 0x79A7, 0x79A4, 0x396B, 0x5BED, 0x7497,
+                                          0x126A, 0x5BAD, 0x4927, 0x5FED, 0x6B6D, 0x2B6A, 0x6BA4, 0x2B73, 0x6BAD,
+                                          0x388E, 0x7492, 0x5B6F, 0x5B6A, 0x5BFD, 0x5AAD, 0x5A92, 0x72A7};
+
+static Uint16 OverlayGlyph(char c)
+{
+    if (c >= '0' && c <= '9')
+        return overlayDigits[c - '0'];
+    if (c >= 'A' && c <= 'Z')
+        return overlayLetters[c - 'A'];
+    if (c >= 'a' && c <= 'z')
+        return overlayLetters[c - 'a'];
+    switch (c)
+    {
+    case '.':
+        return 0x0002;
+    case '-':
+        return 0x01C0;
+    case ':':
+        return 0x0410;
+    case '/':
+        return 0x12A4;
+    case '%':
+        return 0x52A5;
+    default:
+        return 0;
+    }
+}
+
+static void DrawOverlayText(const Canvas *canvas, int x, int y, const char *text, Uint32 color)
+{
+    for (; *text; text++, x += 4)
+    {
+        Uint16 glyph = OverlayGlyph(*text);
+        for (int row = 0; row < 5; row++)
+        {
+            for (int column = 0; column < 3; column++)
+            {
+                if (glyph & (1 << (14 - row * 3 - column)))
+                    DrawPixel(canvas, x + column, y + row, color);
+            }
+        }
+    }
+}
+
+// Averages over the stats window drawn into the top left of the back buffer
+void DrawStatsOverlay()
+{
+    double phases[PHASE_COUNT] = {0};
+    double pixels = 0.0, frame = 0.0, memory = 0.0, latency = 0.0;
+    int count = frameStats.sampleCount;
+    for (int i = 0; i < count; i++)
+    {
+        for (int phase = 0; phase < PHASE_COUNT; phase++)
+            phases[phase] += frameStats.samples[i].phases[phase] * 1000.0 / count;
+        pixels += (double)frameStats.samples[i].pixels / count;
+    }
+    for (int i = 0; i < pacer.sampleCount; i++)
+        frame += pacer.samples[i] * 1000.0 / pacer.sampleCount;
+    for (int i = 0; i < frameStats.latencyCount; i++)
+        latency += frameStats.latencies[i] * 1000.0 / frameStats.latencyCount;
+    if (count > 0)
+        memory = frameStats.samples[(frameStats.nextSample + FRAME_SAMPLES - 1) % FRAME_SAMPLES].luaKilobytes;
+
+    char lines[10][32];
+    snprintf(lines[0], sizeof(lines[0]), "FPS %.1f", frame > 0.0 ? 1000.0 / frame : 0.0);
+    snprintf(lines[1], sizeof(lines[1]), "FRAME %.2f MS", frame);
+    snprintf(lines[2], sizeof(lines[2]), "EVENTS %.2f", phases[PHASE_EVENTS]);
+    snprintf(lines[3], sizeof(lines[3]), "UPDATE %.2f", phases[PHASE_UPDATE]);
+    snprintf(lines[4], sizeof(lines[4]), "SWAP %.2f", phases[PHASE_SWAP]);
+    snprintf(lines[5], sizeof(lines[5]), "UPLOAD %.2f", phases[PHASE_UPLOAD]);
+    snprintf(lines[6], sizeof(lines[6]), "PRESENT %.2f", phases[PHASE_PRESENT]);
+    snprintf(lines[7], sizeof(lines[7]), "PIXELS %.0f", pixels);
+    snprintf(lines[8], sizeof(lines[8]), "LUA %.0f KB", memory);
+    snprintf(lines[9], sizeof(lines[9]), "LATENCY %.2f", latency);
+
+    int longest = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        int length = (int)strlen(lines[i]);
+        if (length > longest)
+            longest = length;
+    }
+    int panelWidth = longest * 4 + 3;
+    int panelHeight = 10 * 6 + 3;
+
+    Canvas canvas = ScreenCanvas();
+    DrawFillRect(&canvas, 0, 0, panelWidth, panelHeight, paletteColors[EncodeColor(0, 0, 0)]);
+    for (int i = 0; i < 10; i++)
+        DrawOverlayText(&canvas, 2, 2 + i * 6, lines[i], paletteColors[EncodeColor(7, 7, 7)]);
+    MarkDirty(0, 0, panelWidth - 1, panelHeight - 1);
+}
+
+static Uint32 HashProfileStack(const char *stack)
+{
+    Uint32 hash = 2166136261u;
+    for (; *stack; stack++)
+        hash = (hash ^ (Uint8)*stack) * 16777619u;
+    return hash;
+}
+
+// Count samples against a stack, the table doubles when it gets half full
+static void AddProfileStack(const char *stack, int samples)
+{
+    if (profiler.count * 2 >= profiler.capacity)
+    {
+        int capacity = profiler.capacity ? profiler.capacity * 2 : 256;
+        ProfileStack *stacks = (ProfileStack *)calloc(capacity, sizeof(ProfileStack));
+        if (!stacks)
+            return;
+        for (int i = 0; i < profiler.capacity; i++)
+        {
+            if (!profiler.stacks[i].stack)
+                continue;
+            Uint32 slot = HashProfileStack(profiler.stacks[i].stack) & (capacity - 1);
+            while (stacks[slot].stack)
+                slot = (slot + 1) & (capacity - 1);
+            stacks[slot] = profiler.stacks[i];
+        }
+        free(profiler.stacks);
+        profiler.stacks = stacks;
+        profiler.capacity = capacity;
+    }
+
+    Uint32 slot = HashProfileStack(stack) & (profiler.capacity - 1);
+    while (profiler.stacks[slot].stack && strcmp(profiler.stacks[slot].stack, stack) != 0)
+        slot = (slot + 1) & (profiler.capacity - 1);
+    if (!profiler.stacks[slot].stack)
+    {
+        profiler.stacks[slot].stack = strdup(stack);
+        if (!profiler.stacks[slot].stack)
+            return;
+        profiler.count++;
+    }
+    profiler.stacks[slot].count += samples;
+    profiler.samples += samples;
+}
+
+// Runs on the main thread at the first safe point after a tick, the time a C function took lands on the line that called it
+static void ProfilerSample(void *data, lua_State *state, int ticks, int vmstate)
+{
+    (void)data;
+    (void)vmstate;
+    if (!profiler.insideLua)
+        return;
+
+    // Ticks are handed over at the next safe point, which can be the first one after a present. Only as many as fit
+    // in the time since entering Lua or the last sample count
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint64 elapsedMs = (now - profiler.sampledAt) * 1000 / SDL_GetPerformanceFrequency();
+    int fit = (int)(elapsedMs / profiler.intervalMs) + 1;
+    profiler.sampledAt = now;
+    if (ticks > fit)
+        ticks = fit;
+
+    lua_Debug frame;
+    int depth = 0;
+    while (depth < PROFILE_DEPTH && lua_getstack(state, depth, &frame))
+        depth++;
+
+    char stack[PROFILE_DEPTH * 96];
+    size_t used = 0;
+    stack[0] = '\0';
+    for (int level = depth - 1; level >= 0; level--)
+    {
+        if (!lua_getstack(state, level, &frame) || !lua_getinfo(state, "Sn", &frame))
+            continue;
+
+        char name[160];
+        if (frame.what && strcmp(frame.what, "C") == 0)
+            snprintf(name, sizeof(name), "%s [C]", frame.name ? frame.name : "?");
+        else if (frame.what && strcmp(frame.what, "main") == 0)
+            snprintf(name, sizeof(name), "main chunk %s", frame.short_src);
+        else if (frame.name)
+            snprintf(name, sizeof(name), "%s %s:%d", frame.name, frame.short_src, frame.linedefined);
+        else
+            snprintf(name, sizeof(name), "%s:%d", frame.short_src, frame.linedefined);
+
+        // ; splits frames in the collapsed format
+        for (char *c = name; *c; c++)
+        {
+            if (*c == ';')
+                *c = ':';
+        }
+        int written = snprintf(stack + used, sizeof(stack) - used, "%s%s", used ? ";" : "", name);
+        if (written < 0 || (size_t)written >= sizeof(stack) - used)
+            break;
+        used += written;
+    }
+    if (used > 0)
+        AddProfileStack(stack, ticks);
+}
+
+// Main loop, around events and update
+void SetProfilerInsideLua(bool inside)
+{
+    profiler.insideLua = inside;
+    if (inside)
+        profiler.sampledAt = SDL_GetPerformanceCounter();
+}
+
+// Start sampling every intervalMs, dropping anything recorded before
+bool StartProfiler(int intervalMs)
+{
+    if (profiler.running)
+        StopProfiler();
+    ClearProfile();
+    profiler.intervalMs = intervalMs > 0 ? intervalMs : 1;
+    profiler.sampledAt = SDL_GetPerformanceCounter();
+    char mode[16];
+    snprintf(mode, sizeof(mode), "i%d", profiler.intervalMs);
+    luaJIT_profile_start(L, mode, ProfilerSample, NULL);
+    profiler.running = true;
+    return true;
+}
+
+void StopProfiler()
+{
+    if (!profiler.running)
+        return;
+    luaJIT_profile_stop(L);
+    profiler.running = false;
+}
+
+void ClearProfile()
+{
+    for (int i = 0; i < profiler.capacity; i++)
+        free(profiler.stacks[i].stack);
+    free(profiler.stacks);
+    profiler.stacks = NULL;
+    profiler.capacity = profiler.count = profiler.samples = 0;
+}
+
+static int CompareProfileStacks(const void *a, const void *b)
+{
+    const ProfileStack *x = *(const ProfileStack *const *)a;
+    const ProfileStack *y = *(const ProfileStack *const *)b;
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+// Most sampled first, one "stack count" line each
+static void WriteProfile(FILE *file)
+{
+    ProfileStack **sorted = (ProfileStack **)malloc((profiler.count + 1) * sizeof(ProfileStack *));
+    if (!sorted)
+        return;
+    int count = 0;
+    for (int i = 0; i < profiler.capacity; i++)
+    {
+        if (profiler.stacks[i].stack)
+            sorted[count++] = &profiler.stacks[i];
+    }
+    qsort(sorted, count, sizeof(ProfileStack *), CompareProfileStacks);
+    for (int i = 0; i < count; i++)
+        fprintf(file, "%s %d\n", sorted[i]->stack, sorted[i]->count);
+    free(sorted);
+}
+
+bool SaveProfile(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+    WriteProfile(file);
+    return fclose(file) == 0;
+}
+
+// F9: start the profiler, or stop it and save what it got to PROFILE_FILE
+void ToggleProfiler()
+{
+    if (!profiler.running)
+    {
+        if (StartProfiler(1))
+            LOG("Profiler started, F9 again to stop\n");
+        return;
+    }
+
+    StopProfiler();
+    if (SaveProfile(PROFILE_FILE))
+        LOG("Profiler stopped, %d samples saved to %s\n", profiler.samples, PROFILE_FILE);
+    else
+        LOG("Failed to save %s\n", PROFILE_FILE);
+}
+
+// Add a finished zone to the ring, overwriting the oldest once it's full
+void TraceZone(const char *name, const char *category, int thread, Uint64 start, Uint64 end)
+{
+    TraceEvent *event = &tracer.events[tracer.written % TRACE_CAPACITY];
+    snprintf(event->name, sizeof(event->name), "%s", name);
+    event->category = category;
+    event->thread = thread;
+    event->start = start;
+    event->duration = end - start;
+    tracer.written++;
+}
+
+// Start recording from an empty ring
+bool StartTrace()
+{
+    if (!tracer.events)
+    {
+        tracer.events = (TraceEvent *)malloc(TRACE_CAPACITY * sizeof(TraceEvent));
+        if (!tracer.events)
+        {
+            LOG("Failed to allocate the trace buffer\n");
+            return false;
+        }
+    }
+    tracer.written = 0;
+    tracer.origin = SDL_GetPerformanceCounter();
+    tracer.recording = true;
+    return true;
+}
+
+void StopTrace()
+{
+    tracer.recording = false;
+}
+
+// Names come from scripts, so quotes, backslashes and control characters need escaping
+static void WriteTraceString(FILE *file, const char *text)
+{
+    fputc('"', file);
+    for (; *text; text++)
+    {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+// Write what the ring holds, oldest first, as complete ("X") events on the loop's thread and the presenting one
+bool SaveTrace(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    double microseconds = 1000000.0 / (double)SDL_GetPerformanceFrequency();
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", TRACE_LOOP,
+            pipelined ? "update" : "main");
+    if (pipelined)
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"main\"}}", TRACE_PRESENT);
+    Uint64 first = tracer.written > TRACE_CAPACITY ? tracer.written - TRACE_CAPACITY : 0;
+    for (Uint64 i = first; i < tracer.written; i++)
+    {
+        const TraceEvent *event = &tracer.events[i % TRACE_CAPACITY];
+        // Zones begun before the trace started are clipped to its start
+        Uint64 start = event->start > tracer.origin ? event->start : tracer.origin;
+        Uint64 end = event->start + event->duration;
+        fprintf(file, ",\n{\"name\":");
+        WriteTraceString(file, event->name);
+        fprintf(file, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event->category,
+                event->thread, (double)(start - tracer.origin) * microseconds, (double)(end > start ? end - start : 0) * microseconds);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(file) == 0;
+}
+
+// F10: start tracing, or stop and save it to TRACE_FILE
+void ToggleTrace()
+{
+    if (!tracer.recording)
+    {
+        if (StartTrace())
+            LOG("Trace started, F10 again to stop\n");
+        return;
+    }
+
+    StopTrace();
+    if (SaveTrace(TRACE_FILE))
+        LOG("Trace stopped, saved to %s\n", TRACE_FILE);
+    else
+        LOG("Failed to save %s\n", TRACE_FILE);
+}
+
+// Lua button number for an SDL mouse button, 0 for ones scripts don't see
+static int MouseButtonToLua(Uint8 button)
+{
+    switch (button)
+    {
+    case SDL_BUTTON_LEFT:
+        return 1;
+    case SDL_BUTTON_RIGHT:
+        return 2;
+    case SDL_BUTTON_MIDDLE:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+// Name a key the way keyboard.down takes it: a lowercase character, one of namedKeys, or SDL's name lowercased
+static void KeyName(const SDL_Keysym *keysym, char *name, size_t size)
+{
+    for (size_t i = 0; i < sizeof(namedKeys) / sizeof(namedKeys[0]); i++)
+    {
+        if (namedKeys[i].scancode == keysym->scancode)
+        {
+            snprintf(name, size, "%s", namedKeys[i].name);
+            return;
+        }
+    }
+
+    if (keysym->sym > 0 && keysym->sym < 128 && isprint(keysym->sym))
+    {
+        snprintf(name, size, "%c", tolower(keysym->sym));
+        return;
+    }
+
+    snprintf(name, size, "%s", SDL_GetKeyName(keysym->sym));
+    for (char *c = name; *c; c++)
+        *c = (char)tolower((unsigned char)*c);
+}
+
+// Add an input event to this frame's list
+void QueueEvent(const SDL_Event *e)
+{
+    bool batched = eventQueue.callbackRef != LUA_NOREF;
+    FrameEvent event = {0};
+
+    switch (e->type)
+    {
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+        event.type = e->type == SDL_MOUSEBUTTONDOWN ? EVENT_MOUSE_DOWN : EVENT_MOUSE_UP;
+        event.button = MouseButtonToLua(e->button.button);
+        if (event.button == 0)
+            return;
+        event.inside = WindowToBuffer(e->button.x, e->button.y, &event.x, &event.y);
+        break;
+    case SDL_MOUSEMOTION:
+    {
+        if (!batched)
+            return;
+        int lastX, lastY;
+        event.type = EVENT_MOUSE_MOVE;
+        event.inside = WindowToBuffer(e->motion.x, e->motion.y, &event.x, &event.y);
+        WindowToBuffer(e->motion.x - e->motion.xrel, e->motion.y - e->motion.yrel, &lastX, &lastY);
+        event.dx = event.x - lastX;
+        event.dy = event.y - lastY;
+
+        // Back to back motion is merged so a fast mouse doesn't flood the list
+        FrameEvent *previous = eventQueue.count > 0 ? &eventQueue.events[eventQueue.count - 1] : NULL;
+        if (previous && previous->type == EVENT_MOUSE_MOVE)
+        {
+            event.dx += previous->dx;
+            event.dy += previous->dy;
+            *previous = event;
+            return;
+        }
+        break;
+    }
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+        if (!batched)
+            return;
+        event.type = e->type == SDL_KEYDOWN ? EVENT_KEY_DOWN : EVENT_KEY_UP;
+        event.code = e->key.keysym.scancode;
+        event.repeated = e->key.repeat != 0;
+        KeyName(&e->key.keysym, event.key, sizeof(event.key));
+        break;
+    case SDL_TEXTINPUT:
+        if (!batched)
+            return;
+        event.type = EVENT_TEXT;
+        memcpy(event.text, e->text.text, sizeof(event.text));
+        event.text[sizeof(event.text) - 1] = '\0';
+        break;
+    default:
+        return;
+    }
+
+    if (eventQueue.count == eventQueue.capacity)
+    {
+        int capacity = eventQueue.capacity ? eventQueue.capacity * 2 : 64;
+        FrameEvent *events = realloc(eventQueue.events, capacity * sizeof(FrameEvent));
+        if (!events)
+        {
+            LOG("Out of memory queueing events\n");
+            return;
+        }
+        eventQueue.events = events;
+        eventQueue.capacity = capacity;
+    }
+    eventQueue.events[eventQueue.count++] = event;
+}
+
+// Fill one reused event table, every field is set so nothing is left from the event it held last frame
+static void FillEventTable(const FrameEvent *event)
+{
+    static const char *typeNames[] = {"mouseDown", "mouseUp", "mouseMove", "keyDown", "keyUp", "text"};
+    bool mouse = event->type == EVENT_MOUSE_DOWN || event->type == EVENT_MOUSE_UP || event->type == EVENT_MOUSE_MOVE;
+    bool key = event->type == EVENT_KEY_DOWN || event->type == EVENT_KEY_UP;
+
+    lua_pushstring(L, typeNames[event->type]);
+    lua_setfield(L, -2, "type");
+
+    if (event->button)
+        lua_pushinteger(L, event->button);
+    else
+        lua_pushnil(L);
+    lua_setfield(L, -2, "button");
+
+    if (mouse && event->inside)
+    {
+        lua_pushinteger(L, event->x);
+        lua_setfield(L, -2, "x");
+        lua_pushinteger(L, event->y);
+    }
+    else
+    {
+        lua_pushnil(L);
+        lua_setfield(L, -2, "x");
+        lua_pushnil(L);
+    }
+    lua_setfield(L, -2, "y");
+
+    if (event->type == EVENT_MOUSE_MOVE)
+    {
+        lua_pushinteger(L, event->dx);
+        lua_setfield(L, -2, "dx");
+        lua_pushinteger(L, event->dy);
+    }
+    else
+    {
+        lua_pushnil(L);
+        lua_setfield(L, -2, "dx");
+        lua_pushnil(L);
+    }
+    lua_setfield(L, -2, "dy");
+
+    if (key)
+    {
+        lua_pushstring(L, event->key);
+        lua_setfield(L, -2, "key");
+        lua_pushinteger(L, event->code);
+        lua_setfield(L, -2, "code");
+        lua_pushboolean(L, event->repeated);
+    }
+    else
+    {
+        lua_pushnil(L);
+        lua_setfield(L, -2, "key");
+        lua_pushnil(L);
+        lua_setfield(L, -2, "code");
+        lua_pushnil(L);
+    }
+    lua_setfield(L, -2, "repeated");
+
+    if (event->type == EVENT_TEXT)
+        lua_pushstring(L, event->text);
+    else
+        lua_pushnil(L);
+    lua_setfield(L, -2, "text");
+}
+
+// Hand this frame's events to Lua, one events(list) call, or mouseDown/mouseUp for scripts without it
+void DispatchEvents()
+{
+    if (eventQueue.count == 0)
+        return;
+
+    if (eventQueue.callbackRef == LUA_NOREF)
+    {
+        for (int i = 0; i < eventQueue.count; i++)
+        {
+            const FrameEvent *event = &eventQueue.events[i];
+            bool down = event->type == EVENT_MOUSE_DOWN;
+
+            lua_getglobal(L, down ? "mouseDown" : "mouseUp");
+            if (lua_isfunction(L, -1))
+            {
+                lua_pushinteger(L, event->button);
+                if (lua_pcall(L, 1, 0, 0) != LUA_OK)
+                {
+                    LOG("Error in Mouse %s: %s\n", down ? "Down" : "Up", lua_tostring(L, -1));
+                    lua_pop(L, 1);
+                }
+            }
+            else
+            {
+                lua_pop(L, 1);
+            }
+        }
+        eventQueue.count = 0;
+        return;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, eventQueue.callbackRef);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, eventQueue.listRef);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, eventQueue.poolRef);
+    int list = lua_gettop(L) - 1;
+    int pool = lua_gettop(L);
+
+    for (int i = 0; i < eventQueue.count; i++)
+    {
+        if (i == eventQueue.poolSize)
+        {
+            lua_createtable(L, 0, 10);
+            lua_rawseti(L, pool, i + 1);
+            eventQueue.poolSize++;
+        }
+        lua_rawgeti(L, pool, i + 1);
+        FillEventTable(&eventQueue.events[i]);
+        lua_rawseti(L, list, i + 1);
+    }
+
+    // Cut the list down if last frame had more
+    for (int i = eventQueue.count; i < eventQueue.listLength; i++)
+    {
+        lua_pushnil(L);
+        lua_rawseti(L, list, i + 1);
+    }
+    eventQueue.listLength = eventQueue.count;
+    eventQueue.count = 0;
+    lua_pop(L, 1);
+
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK)
+    {
+        LOG("Lua Error in 'events': %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+void FreeEvents()
+{
+    free(eventQueue.events);
+    eventQueue.events = NULL;
+    eventQueue.count = eventQueue.capacity = 0;
+}
+
+// Copy part of a frame into the texture
+static void UploadRegion(const Uint32 *pixels, const DirtyRect *region)
+{
+    if (region->minX > region->maxX || region->minY > region->maxY)
+        return;
+    SDL_Rect rect = {region->minX, region->minY, region->maxX - region->minX + 1, region->maxY - region->minY + 1};
+    SDL_UpdateTexture(texture, &rect, pixels + rect.y * bufferWidth + rect.x, bufferWidth * sizeof(Uint32));
+}
+
+// Draw the texture as big as the window allows, keeping its aspect ratio, and present it
+static void PresentTexture()
+{
+    // Clear the renderer
+    SDL_RenderClear(renderer);
+
+    // Calculate scaling
+    int windowWidth, windowHeight;
+    SDL_GetWindowSize(window, &windowWidth, &windowHeight);
+
+    float bufferAspect = (float)bufferWidth / bufferHeight;
+    float windowAspect = (float)windowWidth / windowHeight;
+
+    SDL_Rect destRect;
+    if (windowAspect > bufferAspect)
+    {
+        destRect.h = windowHeight;
+        destRect.w = (int)(windowHeight * bufferAspect);
+        destRect.x = (windowWidth - destRect.w) / 2;
+        destRect.y = 0;
+    }
+    else
+    {
+        destRect.w = windowWidth;
+        destRect.h = (int)(windowWidth / bufferAspect);
+        destRect.x = 0;
+        destRect.y = (windowHeight - destRect.h) / 2;
+    }
+
+    // Render the texture
+    SDL_RenderCopy(renderer, texture, NULL, &destRect);
+
+    // Present the renderer
+    SDL_RenderPresent(renderer);
+}
+
+void DrawBuffer()
+{
+    Uint64 phaseMark = SDL_GetPerformanceCounter();
+
+    // Update the texture with what was drawn this frame plus whatever is left from the last one
+    if (persistentCanvas)
+    {
+        // One buffer, only what changed since the last upload is sent
+        DirtyRect upload = dirtyBack;
+        UniteDirty(&upload, &dirtyUploaded);
+        UploadRegion(pixelsBack, &upload);
+        dirtyUploaded.minX = dirtyUploaded.minY = 0;
+        dirtyUploaded.maxX = dirtyUploaded.maxY = -1;
+        dirtyBack = dirtyUploaded;
+    }
+    else if (!lockedRendering)
+    {
+        DirtyRect upload = dirtyFront;
+        UniteDirty(&upload, &dirtyUploaded);
+        UploadRegion(pixelsFront, &upload);
+        dirtyUploaded = dirtyFront;
+    }
+
+    EndPhase(PHASE_UPLOAD, &phaseMark);
+    PresentTexture();
+    EndPhase(PHASE_PRESENT, &phaseMark);
+}
+
+// The queued frame that was finished first, or NULL. Called with the pipeline locked
+static PipelineFrame *OldestQueuedFrame()
+{
+    PipelineFrame *oldest = NULL;
+    for (int i = 0; i < PIPELINE_FRAMES; i++)
+    {
+        PipelineFrame *frame = &pipeline.frames[i];
+        if (frame->state == FRAME_QUEUED && (!oldest || frame->sequence < oldest->sequence))
+            oldest = frame;
+    }
+    return oldest;
+}
+
+// Wake the main thread out of its wait for events
+void WakeMainThread()
+{
+    SDL_Event e;
+    memset(&e, 0, sizeof(e));
+    e.type = pipeline.wakeEvent;
+    SDL_PushEvent(&e);
+}
+
+// The front buffer becomes the first frame in flight. The update thread is started by RunPipelined
+bool StartPipeline()
+{
+    DirtyRect empty = {0, 0, -1, -1};
+    for (int i = 0; i < PIPELINE_FRAMES; i++)
+    {
+        PipelineFrame *frame = &pipeline.frames[i];
+        if (i == 0)
+        {
+            frame->pixels = pixelsFront;
+            pixelsFront = NULL;
+        }
+        else
+        {
+            frame->pixels = (Uint32 *)calloc((size_t)bufferWidth * bufferHeight, sizeof(Uint32));
+        }
+        if (!frame->pixels)
+        {
+            LOG("Failed to allocate pixel buffers.\n");
+            return false;
+        }
+        frame->drawn = frame->upload = empty;
+        frame->state = FRAME_FREE;
+    }
+    pipeline.fullscreen = pipeline.cursor = -1;
+
+    pipeline.wakeEvent = SDL_RegisterEvents(1);
+    pipeline.lock = SDL_CreateMutex();
+    pipeline.changed = SDL_CreateCond();
+    if (pipeline.wakeEvent == (Uint32)-1 || !pipeline.lock || !pipeline.changed)
+    {
+        LOG("Failed to set up the update thread: %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+// Frees the frames in flight once RunPipelined is done. Safe after a failed start
+void StopPipeline()
+{
+    for (int i = 0; i < PIPELINE_FRAMES; i++)
+        free(pipeline.frames[i].pixels);
+    free(pipeline.events);
+    free(pipeline.handling);
+    free(pipeline.title);
+    if (pipeline.changed)
+        SDL_DestroyCond(pipeline.changed);
+    if (pipeline.lock)
+        SDL_DestroyMutex(pipeline.lock);
+    memset(&pipeline, 0, sizeof(pipeline));
+}
+
+// Runs the frame loop, then lets the main thread know nothing more is coming
+static int UpdateThread(void *data)
+{
+    int frames = RunFrames(data);
+    SDL_LockMutex(pipeline.lock);
+    pipeline.finished = true;
+    SDL_UnlockMutex(pipeline.lock);
+    WakeMainThread();
+    return frames;
+}
+
+// Main thread: pass an event on to the update thread. F11 is done here since it changes the window
+static void ForwardEvent(const SDL_Event *e)
+{
+    if (e->type == SDL_KEYDOWN && e->key.keysym.sym == SDLK_F11)
+        SetFullscreen(!isFullscreen);
+
+    SDL_LockMutex(pipeline.lock);
+    if (pipeline.eventCount == pipeline.eventCapacity)
+    {
+        int capacity = pipeline.eventCapacity ? pipeline.eventCapacity * 2 : 64;
+        SDL_Event *events = realloc(pipeline.events, capacity * sizeof(SDL_Event));
+        if (!events)
+        {
+            SDL_UnlockMutex(pipeline.lock);
+            LOG("Out of memory queueing events\n");
+            return;
+        }
+        pipeline.events = events;
+        pipeline.eventCapacity = capacity;
+    }
+    pipeline.events[pipeline.eventCount++] = *e;
+    SDL_UnlockMutex(pipeline.lock);
+}
+
+// Update thread: handle what the main thread forwarded since the last frame
+static void HandleForwardedEvents()
+{
+    SDL_LockMutex(pipeline.lock);
+    SDL_Event *events = pipeline.events;
+    int count = pipeline.eventCount;
+    int capacity = pipeline.eventCapacity;
+    pipeline.events = pipeline.handling;
+    pipeline.eventCapacity = pipeline.handlingCapacity;
+    pipeline.eventCount = 0;
+    pipeline.handling = events;
+    pipeline.handlingCapacity = capacity;
+    SDL_UnlockMutex(pipeline.lock);
+
+    for (int i = 0; i < count; i++)
+        HandleEvent(&events[i]);
+}
+
+// Main thread: make the window changes Lua asked for since last time
+static void ApplyWindowRequests()
+{
+    SDL_LockMutex(pipeline.lock);
+    char *title = pipeline.title;
+    int fullscreen = pipeline.fullscreen;
+    int cursor = pipeline.cursor;
+    bool centerMouse = pipeline.centerMouse;
+    const char *message = pipeline.message;
+    pipeline.title = NULL;
+    pipeline.fullscreen = pipeline.cursor = -1;
+    pipeline.centerMouse = false;
+    SDL_UnlockMutex(pipeline.lock);
+
+    if (title)
+    {
+        SDL_SetWindowTitle(window, title);
+        free(title);
+    }
+    if (fullscreen >= 0)
+        SetFullscreen(fullscreen);
+    if (cursor >= 0)
+        SDL_ShowCursor(cursor ? SDL_ENABLE : SDL_DISABLE);
+    if (centerMouse)
+        CenterMouse();
+    if (message)
+    {
+        ShowMessage(message);
+        SDL_LockMutex(pipeline.lock);
+        pipeline.message = NULL;
+        SDL_CondBroadcast(pipeline.changed);
+        SDL_UnlockMutex(pipeline.lock);
+    }
+}
+
+// Main thread when pipelined: start the update thread, then present what it queues in order and keep events and
+// window changes moving until it's done. Returns how many frames it ran
+int RunPipelined(LaunchOptions *options)
+{
+    pipeline.thread = SDL_CreateThread(UpdateThread, "plf update", options);
+    if (!pipeline.thread)
+    {
+        LOG("Failed to create the update thread: %s\n", SDL_GetError());
+        return 0;
+    }
+
+    bool finished = false;
+    while (!finished)
+    {
+        // A queued frame or a window request pushes a wake event, the timeout is only a fallback
+        SDL_Event e;
+        if (SDL_WaitEventTimeout(&e, 100))
+        {
+            do
+            {
+                if (e.type != pipeline.wakeEvent)
+                    ForwardEvent(&e);
+            } while (SDL_PollEvent(&e));
+        }
+        ApplyWindowRequests();
+
+        SDL_LockMutex(pipeline.lock);
+        PipelineFrame *frame;
+        while ((frame = OldestQueuedFrame()))
+        {
+            frame->state = FRAME_PRESENTING;
+            SDL_UnlockMutex(pipeline.lock);
+
+            frame->uploadStart = SDL_GetPerformanceCounter();
+            UploadRegion(frame->pixels, &frame->upload);
+            frame->uploadEnd = SDL_GetPerformanceCounter();
+            PresentTexture();
+            frame->presentEnd = SDL_GetPerformanceCounter();
+
+            SDL_LockMutex(pipeline.lock);
+            frame->state = FRAME_FREE;
+            frame->presented = true;
+            SDL_CondBroadcast(pipeline.changed);
+        }
+        // Everything queued before the loop ended has been shown
+        finished = pipeline.finished;
+        SDL_UnlockMutex(pipeline.lock);
+    }
+
+    int frames = 0;
+    SDL_WaitThread(pipeline.thread, &frames);
+    pipeline.thread = NULL;
+    return frames;
+}
+
+// Move the main thread's timings for presented frames into this frame's stats. Called with the pipeline locked
+static void CollectPresentedLocked()
+{
+    double frequency = (double)SDL_GetPerformanceFrequency();
+    for (int i = 0; i < PIPELINE_FRAMES; i++)
+    {
+        PipelineFrame *frame = &pipeline.frames[i];
+        if (!frame->presented)
+            continue;
+        frameStats.current.phases[PHASE_UPLOAD] += (double)(frame->uploadEnd - frame->uploadStart) / frequency;
+        frameStats.current.phases[PHASE_PRESENT] += (double)(frame->presentEnd - frame->uploadEnd) / frequency;
+        RecordLatency((double)(frame->presentEnd - frame->submitted) / frequency);
+        if (tracer.recording)
+        {
+            TraceZone("upload", "render", TRACE_PRESENT, frame->uploadStart, frame->uploadEnd);
+            TraceZone("present", "render", TRACE_PRESENT, frame->uploadEnd, frame->presentEnd);
+        }
+        frame->presented = false;
+    }
+}
+
+void CollectPresentedFrames()
+{
+    SDL_LockMutex(pipeline.lock);
+    CollectPresentedLocked();
+    SDL_UnlockMutex(pipeline.lock);
+}
+
+// Copy a box of one full size buffer into another
+static void CopyRegion(Uint32 *dest, const Uint32 *src, const DirtyRect *region)
+{
+    if (region->minX > region->maxX || region->minY > region->maxY)
+        return;
+    int width = region->maxX - region->minX + 1;
+    for (int y = region->minY; y <= region->maxY; y++)
+        memcpy(dest + y * bufferWidth + region->minX, src + y * bufferWidth + region->minX, width * sizeof(Uint32));
+}
+
+// Hand the finished back buffer to the main thread, waiting for it to give a frame back if both are in flight.
+// Lua gets the returned buffer to draw next, cleared where it was drawn on
+void SubmitFrame()
+{
+    SDL_LockMutex(pipeline.lock);
+    PipelineFrame *frame = NULL;
+    while (!frame)
+    {
+        for (int i = 0; i < PIPELINE_FRAMES && !frame; i++)
+        {
+            if (pipeline.frames[i].state == FRAME_FREE)
+                frame = &pipeline.frames[i];
+        }
+        if (!frame)
+            SDL_CondWait(pipeline.changed, pipeline.lock);
+    }
+    CollectPresentedLocked();
+    SDL_UnlockMutex(pipeline.lock);
+
+    // A free frame is only ever touched by this thread
+    if (backBufferPinned)
+        MarkAllDirty(); // Writes through the pointer aren't tracked
+    frame->upload = dirtyBack;
+    UniteDirty(&frame->upload, &dirtyUploaded);
+    if (persistentCanvas)
+    {
+        // The canvas stays with Lua, the frame only gets what the texture is missing
+        CopyRegion(frame->pixels, pixelsBack, &frame->upload);
+        UniteDirty(&frame->drawn, &frame->upload);
+        dirtyUploaded.minX = dirtyUploaded.minY = 0;
+        dirtyUploaded.maxX = dirtyUploaded.maxY = -1;
+        dirtyBack = dirtyUploaded;
+    }
+    else
+    {
+        dirtyUploaded = dirtyBack;
+        if (backBufferPinned)
+        {
+            memcpy(frame->pixels, pixelsBack, (size_t)bufferWidth * bufferHeight * sizeof(Uint32));
+            frame->drawn = dirtyBack;
+        }
+        else
+        {
+            Uint32 *temp = frame->pixels;
+            frame->pixels = pixelsBack;
+            pixelsBack = temp;
+            DirtyRect tempDirty = frame->drawn;
+            frame->drawn = dirtyBack;
+            dirtyBack = tempDirty;
+        }
+        ClearDirty(pixelsBack, &dirtyBack);
+    }
+
+    SDL_LockMutex(pipeline.lock);
+    frame->submitted = SDL_GetPerformanceCounter();
+    frame->sequence = pipeline.nextSequence++;
+    frame->state = FRAME_QUEUED;
+    SDL_UnlockMutex(pipeline.lock);
+    WakeMainThread();
+}
+
+// Implement Lua functions here
+
+int color_rgb(lua_State *L)
+{
+    int r = luaL_checkinteger(L, 1);
+    int g = luaL_checkinteger(L, 2);
+    int b = luaL_checkinteger(L, 3);
+
+    if (r < 0 || r > 7 || g < 0 || g > 7 || b < 0 || b > 7)
+    {
+        return luaL_error(L, "RGB values must be between 0 and 7");
+    }
+
+    int encodedValue = EncodeColor(r, g, b);
+    lua_pushinteger(L, encodedValue);
+    return 1;
+}
+
+int color_hsv(lua_State *L)
+{
+    int h = luaL_checkinteger(L, 1);
+    int s = luaL_checkinteger(L, 2);
+    int v = luaL_checkinteger(L, 3);
+    if (h < 0 || h > 7 || s < 0 || s > 7 || v < 0 || v > 7)
+    {
+        return luaL_error(L, "HSV values must be between 0 and 7");
+    }
+
+    float hue = h / 7.0f * 360.0f;
+    float saturation = s / 7.0f;
+    float value = v / 7.0f;
+
+    float c = value * saturation;
+    float x = c * (1 - fabsf(fmodf(hue / 60.0f, 2) - 1));
+    float m = value - c;
+
+    float r_prime, g_prime, b_prime;
+
+    if (hue < 60)
+    {
+        r_prime = c;
+        g_prime = x;
+        b_prime = 0;
+    }
+    else if (hue < 120)
+    {
+        r_prime = x;
+        g_prime = c;
+        b_prime = 0;
+    }
+    else if (hue < 180)
+    {
+        r_prime = 0;
+        g_prime = c;
+        b_prime = x;
+    }
+    else if (hue < 240)
+    {
+        r_prime = 0;
+        g_prime = x;
+        b_prime = c;
+    }
+    else if (hue < 300)
+    {
+        r_prime = x;
+        g_prime = 0;
+        b_prime = c;
+    }
+    else
+    {
+        r_prime = c;
+        g_prime = 0;
+        b_prime = x;
+    }
+
+    int r = (int)((r_prime + m) * 7 + 0.5f); // Added 0.5f for rounding
+    int g = (int)((g_prime + m) * 7 + 0.5f);
+    int b = (int)((b_prime + m) * 7 + 0.5f);
+
+    // Clamp values to [0,7]
+    if (r > 7)
+        r = 7;
+    if (g > 7)
+        g = 7;
+    if (b > 7)
+        b = 7;
+
+    int encodedValue = EncodeColor(r, g, b);
+    lua_pushinteger(L, encodedValue);
+    return 1;
+}
+
+int color_greyscale(lua_State *L)
+{
+    Uint32 encodedColor = luaL_checkinteger(L, 1);
+    // Decode the color to get the mapped Uint32 color
+    Uint32 mappedColor = DecodeColor(encodedColor);
+
+    // Extract r, g, b components using SDL_GetRGBA
+    Uint8 r, g, b, a;
+    SDL_GetRGBA(mappedColor, globalFormat, &r, &g, &b, &a);
+
+    // Calculate the grayscale value
+    Uint8 gray = (Uint8)(((int)r + (int)g + (int)b) / 3);
+    int grayIndex = gray * 7 / 255; // Map 0-255 to 0-7
+    if (grayIndex > 7)
+        grayIndex = 7;
+
+    // Encode the grayscale color
+    int greyscaleColor = EncodeColor(grayIndex, grayIndex, grayIndex);
+    lua_pushinteger(L, greyscaleColor);
+    return 1;
+}
+
+int texture_fromShader(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int width = luaL_checkinteger(L, 2);
+    int height = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, width > 0, 2, "width must be positive");
+    luaL_argcheck(L, height > 0, 3, "height must be positive");
+
+    Texture *tex = AllocTexture(width, height);
+    if (!tex)
+    {
+        return luaL_error(L, "Failed to allocate memory for texture");
+    }
+    PushTexture(L, tex);
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            lua_pushvalue(L, 1); // Push the shader function
+            lua_pushinteger(L, x);
+            lua_pushinteger(L, y);
+            if (lua_pcall(L, 2, 1, 0) != LUA_OK)
+            {
+                LOG("Error in Shader: %s\n", lua_tostring(L, -1));
+                lua_pop(L, 1);
+                lua_pushinteger(L, EncodeColor(0, 0, 0)); // default color if error
+            }
+            int value = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            tex->pixels[y * width + x] = TexturePixel(value);
+        }
+    }
+    UpdateTextureOpacity(tex);
+    return 1;
+}
+
+int texture_fromRom(lua_State *L)
+{
+    const char *imageName = luaL_checkstring(L, 1);
+
+    if (strlen(romPathGlobal) == 0)
+    {
+        return luaL_error(L, "ROM path not provided.");
+    }
+
+    if (!rom.data)
+    {
+        return luaL_error(L, "%s: %s", rom.error, romPathGlobal);
+    }
+
+    RomImage *image = FindRomImage(imageName);
+    if (!image)
+    {
+        return luaL_error(L, "Image '%s' not found in ROM file", imageName);
+    }
+
+    if (image->numPixels != image->width * image->height)
+    {
+        return luaL_error(L, "Image size does not match expected dimensions");
+    }
+
+    if (image->numPixels > 1000000)
+    {
+        return luaL_error(L, "Image too large to load");
+    }
+
+    // Hand out another reference to the decoded copy if it is still cached
+    if (image->cached)
+    {
+        textureCache.hits++;
+        TouchCachedTexture(image);
+        RetainTexture(image->cached);
+        PushTexture(L, image->cached);
+        return 1;
+    }
+    textureCache.misses++;
+
+    Texture *tex = AllocTexture(image->width, image->height);
+    if (!tex)
+    {
+        return luaL_error(L, "Failed to allocate memory for texture");
+    }
+
+    DecodeRomImage(image, tex->pixels);
+    UpdateTextureOpacity(tex);
+    CacheRomTexture(image, tex);
+    PushTexture(L, tex);
+    return 1;
+}
+
+// texture.loadAsync(ids) returns a handle straight away and decodes the images on the loader thread.
+// Ids that are already cached are ready at once, bad ids are errors here like they are for texture.fromRom
+int texture_loadAsync(lua_State *L)
+{
+    int listed = 1;
+    if (!lua_isstring(L, 1))
+    {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        listed = lua_objlen(L, 1);
+        luaL_argcheck(L, listed > 0, 1, "no ids to load");
+    }
+
+    if (strlen(romPathGlobal) == 0)
+    {
+        return luaL_error(L, "ROM path not provided.");
+    }
+    if (!rom.data)
+    {
+        return luaL_error(L, "%s: %s", rom.error, romPathGlobal);
+    }
+
+    // The handle owns the request from the start so an error part way through still frees it
+    LoadRequest **box = (LoadRequest **)lua_newuserdata(L, sizeof(LoadRequest *));
+    *box = (LoadRequest *)calloc(1, sizeof(LoadRequest) + (size_t)listed * sizeof(LoadItem));
+    if (!*box)
+    {
+        return luaL_error(L, "Failed to allocate memory for the load");
+    }
+    luaL_getmetatable(L, LOAD_METATABLE);
+    lua_setmetatable(L, -2);
+    LoadRequest *request = *box;
+
+    for (int i = 1; i <= listed; i++)
+    {
+        const char *imageName;
+        if (lua_isstring(L, 1))
+        {
+            imageName = lua_tostring(L, 1);
+        }
+        else
+        {
+            lua_rawgeti(L, 1, i);
+            imageName = lua_tostring(L, -1);
+            lua_pop(L, 1); // Still referenced by the table
+        }
+        if (!imageName)
+        {
+            return luaL_error(L, "Load id %d is not a string", i);
+        }
+        RomImage *image = FindRomImage(imageName);
+        if (!image)
+        {
+            return luaL_error(L, "Image '%s' not found in ROM file", imageName);
+        }
+        if (image->numPixels != image->width * image->height)
+        {
+            return luaL_error(L, "Image size does not match expected dimensions");
+        }
+        if (image->numPixels > 1000000)
+        {
+            return luaL_error(L, "Image too large to load");
+        }
+
+        LoadItem *item = &request->items[request->count++];
+        item->id = image->id;
+        item->image = image;
+        if (image->cached)
+        {
+            textureCache.hits++;
+            TouchCachedTexture(image);
+            RetainTexture(image->cached);
+            item->texture = image->cached;
+            item->ready = item->collected = true;
+        }
+        else
+        {
+            textureCache.misses++;
+            request->remaining++;
+        }
+    }
+
+    if (request->remaining == 0)
+        return 1;
+    if (!StartAssetLoader())
+    {
+        return luaL_error(L, "Failed to start loading in the background");
+    }
+    SDL_LockMutex(loader.lock);
+    request->queued = true;
+    if (loader.tail)
+        loader.tail->next = request;
+    else
+        loader.head = request;
+    loader.tail = request;
+    SDL_CondBroadcast(loader.wake);
+    SDL_UnlockMutex(loader.lock);
+    return 1;
+}
+
+// Give newly decoded images to the cache, unless the same image got there first. Called with the loader locked
+static void CollectLoadedLocked(LoadRequest *request)
+{
+    for (int i = 0; i < request->count; i++)
+    {
+        LoadItem *item = &request->items[i];
+        if (!item->ready || item->collected)
+            continue;
+        item->collected = true;
+        if (!item->texture)
+            continue;
+        if (item->image->cached)
+        {
+            ReleaseTexture(item->texture);
+            RetainTexture(item->image->cached);
+            item->texture = item->image->cached;
+        }
+        else
+        {
+            CacheRomTexture(item->image, item->texture);
+        }
+    }
+}
+
+// Returns how many images still aren't ready
+static int CollectLoaded(LoadRequest *request)
+{
+    if (!loader.lock)
+        return request->remaining;
+    SDL_LockMutex(loader.lock);
+    CollectLoadedLocked(request);
+    int remaining = request->remaining;
+    SDL_UnlockMutex(loader.lock);
+    return remaining;
+}
+
+static LoadRequest *CheckLoad(lua_State *L)
+{
+    return *(LoadRequest **)luaL_checkudata(L, 1, LOAD_METATABLE);
+}
+
+// handle:poll() returns whether everything is ready, then how many are and how many were asked for
+int load_poll(lua_State *L)
+{
+    LoadRequest *request = CheckLoad(L);
+    int remaining = CollectLoaded(request);
+    lua_pushboolean(L, remaining == 0);
+    lua_pushinteger(L, request->count - remaining);
+    lua_pushinteger(L, request->count);
+    return 3;
+}
+
+// handle:wait(timeoutMs) blocks until everything is ready, or for at most timeoutMs. Returns whether it's all ready
+int load_wait(lua_State *L)
+{
+    LoadRequest *request = CheckLoad(L);
+    lua_Number timeout = luaL_optnumber(L, 2, -1);
+    if (!loader.lock)
+    {
+        lua_pushboolean(L, request->remaining == 0);
+        return 1;
+    }
+
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 deadline = SDL_GetPerformanceCounter() + (Uint64)(timeout > 0 ? timeout * frequency / 1000.0 : 0);
+    SDL_LockMutex(loader.lock);
+    while (request->remaining > 0)
+    {
+        if (timeout < 0)
+        {
+            SDL_CondWait(loader.finished, loader.lock);
+            continue;
+        }
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now >= deadline)
+            break;
+        SDL_CondWaitTimeout(loader.finished, loader.lock, (Uint32)((deadline - now) * 1000 / frequency) + 1);
+    }
+    CollectLoadedLocked(request);
+    bool ready = request->remaining == 0;
+    SDL_UnlockMutex(loader.lock);
+    lua_pushboolean(L, ready);
+    return 1;
+}
+
+// handle:get(id) returns the texture once it's ready, otherwise nil and why not
+int load_get(lua_State *L)
+{
+    LoadRequest *request = CheckLoad(L);
+    Uint32 id = RomImageId(luaL_checkstring(L, 2));
+    CollectLoaded(request);
+    for (int i = 0; i < request->count; i++)
+    {
+        LoadItem *item = &request->items[i];
+        if (item->id != id)
+            continue;
+        if (!item->collected)
+        {
+            lua_pushnil(L);
+            lua_pushliteral(L, "not loaded yet");
+            return 2;
+        }
+        if (!item->texture)
+        {
+            lua_pushnil(L);
+            lua_pushstring(L, item->error);
+            return 2;
+        }
+        RetainTexture(item->texture);
+        PushTexture(L, item->texture);
+        return 1;
+    }
+    return luaL_error(L, "Image '%s' is not part of this load", lua_tostring(L, 2));
+}
+
+// Drop the request from the queue, waiting if the loader is decoding one of its images
+int load_gc(lua_State *L)
+{
+    LoadRequest **box = (LoadRequest **)luaL_checkudata(L, 1, LOAD_METATABLE);
+    LoadRequest *request = *box;
+    if (!request)
+        return 0;
+    if (loader.lock)
+    {
+        SDL_LockMutex(loader.lock);
+        while (loader.current == request)
+            SDL_CondWait(loader.finished, loader.lock);
+        if (request->queued)
+        {
+            LoadRequest *previous = NULL;
+            for (LoadRequest *queued = loader.head; queued != request; queued = queued->next)
+                previous = queued;
+            if (previous)
+                previous->next = request->next;
+            else
+                loader.head = request->next;
+            if (loader.tail == request)
+                loader.tail = previous;
+        }
+        SDL_UnlockMutex(loader.lock);
+    }
+
+    // Decoded images nobody collected were never shared, the rest hold a reference each
+    for (int i = 0; i < request->count; i++)
+    {
+        if (request->items[i].texture)
+            ReleaseTexture(request->items[i].texture);
+    }
+    free(request);
+    *box = NULL;
+    return 0;
+}
+
+// Tallest first keeps the shelves full
+static int CompareAtlasHeight(const void *a, const void *b)
+{
+    const AtlasEntry *first = (const AtlasEntry *)a;
+    const AtlasEntry *second = (const AtlasEntry *)b;
+    if (first->height != second->height)
+        return second->height - first->height;
+    return second->width - first->width;
+}
+
+static int CompareAtlasId(const void *a, const void *b)
+{
+    Uint32 first = ((const AtlasEntry *)a)->id;
+    Uint32 second = ((const AtlasEntry *)b)->id;
+    return first < second ? -1 : first > second;
+}
+
+// Place entries left to right on shelves as tall as their first image, the atlas is about square
+static void PackShelves(AtlasEntry *entries, int count, int *atlasWidth, int *atlasHeight)
+{
+    size_t area = 0;
+    int widest = 0;
+    for (int i = 0; i < count; i++)
+    {
+        area += (size_t)entries[i].width * entries[i].height;
+        if (entries[i].width > widest)
+            widest = entries[i].width;
+    }
+    int width = (int)ceil(sqrt((double)area));
+    if (width < widest)
+        width = widest;
+
+    qsort(entries, count, sizeof(AtlasEntry), CompareAtlasHeight);
+    int x = 0, y = 0, shelfHeight = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (x + entries[i].width > width)
+        {
+            x = 0;
+            y += shelfHeight;
+            shelfHeight = 0;
+        }
+        entries[i].x = x;
+        entries[i].y = y;
+        x += entries[i].width;
+        if (entries[i].height > shelfHeight)
+            shelfHeight = entries[i].height;
+    }
+    *atlasWidth = width;
+    *atlasHeight = y + shelfHeight;
+}
+
+static const AtlasEntry *FindAtlasEntry(const Atlas *atlas, Uint32 id)
+{
+    int low = 0, high = atlas->count - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        if (atlas->entries[mid].id == id)
+            return &atlas->entries[mid];
+        if (atlas->entries[mid].id < id)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return NULL;
+}
+
+// Pack a list of ROM ids into one texture, sprites are then drawn from it with drawing.sprite
+int texture_atlas(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int listed = lua_objlen(L, 1);
+    luaL_argcheck(L, listed > 0, 1, "no ids to pack");
+
+    if (strlen(romPathGlobal) == 0)
+    {
+        return luaL_error(L, "ROM path not provided.");
+    }
+    if (!rom.data)
+    {
+        return luaL_error(L, "%s: %s", rom.error, romPathGlobal);
+    }
+
+    Atlas *atlas = (Atlas *)lua_newuserdata(L, sizeof(Atlas) + (size_t)listed * sizeof(AtlasEntry));
+    atlas->texture = NULL;
+    atlas->count = 0;
+    luaL_getmetatable(L, ATLAS_METATABLE);
+    lua_setmetatable(L, -2);
+
+    for (int i = 1; i <= listed; i++)
+    {
+        lua_rawgeti(L, 1, i);
+        const char *imageName = lua_tostring(L, -1);
+        if (!imageName)
+        {
+            return luaL_error(L, "Atlas id %d is not a string", i);
+        }
+        RomImage *image = FindRomImage(imageName);
+        if (!image)
+        {
+            return luaL_error(L, "Image '%s' not found in ROM file", imageName);
+        }
+        if (image->numPixels != image->width * image->height)
+        {
+            return luaL_error(L, "Image size does not match expected dimensions");
+        }
+        if (image->numPixels > 1000000)
+        {
+            return luaL_error(L, "Image too large to load");
+        }
+        lua_pop(L, 1);
+
+        // The same id twice only needs packing once
+        bool duplicate = false;
+        for (int n = 0; n < atlas->count; n++)
+            duplicate = duplicate || atlas->entries[n].id == image->id;
+        if (duplicate || image->numPixels == 0)
+            continue;
+
+        AtlasEntry *entry = &atlas->entries[atlas->count++];
+        entry->id = image->id;
+        entry->width = image->width;
+        entry->height = image->height;
+    }
+    luaL_argcheck(L, atlas->count > 0, 1, "no images to pack");
+
+    int width, height;
+    PackShelves(atlas->entries, atlas->count, &width, &height);
+    if ((size_t)width * height > 16 * 1024 * 1024)
+    {
+        return luaL_error(L, "Atlas too large");
+    }
+
+    atlas->texture = AllocTexture(width, height);
+    if (!atlas->texture)
+    {
+        return luaL_error(L, "Failed to allocate memory for texture");
+    }
+
+    // Decode straight into place, from the cached copy when there is one
+    Uint32 *scratch = NULL;
+    for (int i = 0; i < atlas->count; i++)
+    {
+        AtlasEntry *entry = &atlas->entries[i];
+        RomImage *image = FindRomImageById(entry->id);
+        const Uint32 *pixels = image->cached ? image->cached->pixels : NULL;
+        if (!pixels)
+        {
+            Uint32 *grown = (Uint32 *)realloc(scratch, (size_t)image->numPixels * sizeof(Uint32));
+            if (!grown)
+            {
+                free(scratch);
+                return luaL_error(L, "Failed to allocate memory for texture");
+            }
+            scratch = grown;
+            DecodeRomImage(image, scratch);
+            pixels = scratch;
+        }
+        for (int y = 0; y < entry->height; y++)
+            memcpy(atlas->texture->pixels + (entry->y + y) * width + entry->x, pixels + y * entry->width, entry->width * sizeof(Uint32));
+    }
+    free(scratch);
+    UpdateTextureOpacity(atlas->texture);
+
+    qsort(atlas->entries, atlas->count, sizeof(AtlasEntry), CompareAtlasId);
+    return 1;
+}
+
+int texture_cacheStats(lua_State *L)
+{
+    lua_createtable(L, 0, 6);
+    lua_pushnumber(L, (lua_Number)textureCache.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, (lua_Number)textureCache.misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushnumber(L, (lua_Number)textureCache.evictions);
+    lua_setfield(L, -2, "evictions");
+    lua_pushinteger(L, textureCache.entries);
+    lua_setfield(L, -2, "entries");
+    lua_pushnumber(L, (lua_Number)textureCache.residentBytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, (lua_Number)textureCache.budget);
+    lua_setfield(L, -2, "budget");
+    return 1;
+}
+
+// Get the cache budget in bytes, or set it and evict down to it straight away
+int texture_cacheBudget(lua_State *L)
+{
+    if (!lua_isnoneornil(L, 1))
+    {
+        lua_Number budget = luaL_checknumber(L, 1);
+        luaL_argcheck(L, budget >= 0, 1, "budget must not be negative");
+        textureCache.budget = (size_t)budget;
+        EvictTextures(textureCache.budget);
+    }
+    lua_pushnumber(L, (lua_Number)textureCache.budget);
+    return 1;
+}
+
+// Convert an old style table of rows into a packed texture
+int texture_fromTable(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    int height = lua_objlen(L, 1);
+    int width = 0;
+    for (int y = 1; y <= height; y++)
+    {
+        lua_rawgeti(L, 1, y);
+        int rowWidth = lua_istable(L, -1) ? (int)lua_objlen(L, -1) : 0;
+        if (rowWidth > width)
+            width = rowWidth;
+        lua_pop(L, 1);
+    }
+    luaL_argcheck(L, width > 0 && height > 0, 1, "texture table is empty");
+
+    Texture *tex = AllocTexture(width, height);
+    if (!tex)
+    {
+        return luaL_error(L, "Failed to allocate memory for texture");
+    }
+    PushTexture(L, tex);
+
+    for (int y = 1; y <= height; y++)
+    {
+        lua_rawgeti(L, 1, y);
+        if (lua_istable(L, -1))
+        {
+            int rowWidth = lua_objlen(L, -1);
+            for (int x = 1; x <= rowWidth; x++)
+            {
+                lua_rawgeti(L, -1, x);
+                tex->pixels[(y - 1) * width + (x - 1)] = TexturePixel(lua_tointeger(L, -1));
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+    }
+    UpdateTextureOpacity(tex);
+    return 1;
+}
+
+int texture_width(lua_State *L)
+{
+    Texture *tex = CheckTexture(L, 1);
+    lua_pushinteger(L, tex->width);
+    return 1;
+}
+
+int texture_height(lua_State *L)
+{
+    Texture *tex = CheckTexture(L, 1);
+    lua_pushinteger(L, tex->height);
+    return 1;
+}
+
+int texture_get(lua_State *L)
+{
+    Texture *tex = CheckTexture(L, 1);
+    int x = luaL_checkinteger(L, 2);
+    int y = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, x >= 0 && x < tex->width, 2, "x out of range");
+    luaL_argcheck(L, y >= 0 && y < tex->height, 3, "y out of range");
+
+    Uint32 pixel = tex->pixels[y * tex->width + x];
+    if (pixel == 0)
+    {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    // Every palette channel is a multiple of 36, so dividing gets the index back
+    Uint8 r, g, b, a;
+    SDL_GetRGBA(pixel, globalFormat, &r, &g, &b, &a);
+    lua_pushinteger(L, EncodeColor(r / 36, g / 36, b / 36));
+    return 1;
+}
+
+int texture_set(lua_State *L)
+{
+    Texture *tex = CheckWritableTexture(L, 1);
+    int x = luaL_checkinteger(L, 2);
+    int y = luaL_checkinteger(L, 3);
+    int color = luaL_checkinteger(L, 4);
+    luaL_argcheck(L, x >= 0 && x < tex->width, 2, "x out of range");
+    luaL_argcheck(L, y >= 0 && y < tex->height, 3, "y out of range");
+
+    // Queued blits have to see the texture as it was when they were drawn
+    if (tex->refCount > 1)
+        FlushDeferred();
+    Uint32 pixel = TexturePixel(color);
+    tex->pixels[y * tex->width + x] = pixel;
+    if (pixel == 0)
+        tex->opaque = false;
+    return 0;
+}
+
+// Private copy of a texture
+int texture_copy(lua_State *L)
+{
+    Texture *tex = CheckTexture(L, 1);
+    Texture *copy = AllocTexture(tex->width, tex->height);
+    if (!copy)
+    {
+        return luaL_error(L, "Failed to allocate memory for texture");
+    }
+    memcpy(copy->pixels, tex->pixels, (size_t)tex->width * tex->height * sizeof(Uint32));
+    copy->opaque = tex->opaque;
+    PushTexture(L, copy);
+    return 1;
+}
+
+// How often the texture was drawn, how many pixels that wrote and how long it took, for measuring layers
+int texture_stats(lua_State *L)
+{
+    Texture *tex = CheckTexture(L, 1);
+    lua_createtable(L, 0, 3);
+    lua_pushnumber(L, (double)tex->blitCount);
+    lua_setfield(L, -2, "draws");
+    lua_pushnumber(L, (double)tex->blitPixels);
+    lua_setfield(L, -2, "pixels");
+    lua_pushnumber(L, (double)tex->blitTicks * 1000.0 / (double)SDL_GetPerformanceFrequency());
+    lua_setfield(L, -2, "ms");
+    return 1;
+}
+
+int texture_gc(lua_State *L)
+{
+    Texture **box = (Texture **)luaL_checkudata(L, 1, TEXTURE_METATABLE);
+    if (*box)
+        ReleaseTexture(*box);
+    *box = NULL;
+    return 0;
+}
+
+// The packed texture, for drawing.sprite with a source rectangle or tex:stats
+int atlas_texture(lua_State *L)
+{
+    Atlas *atlas = (Atlas *)luaL_checkudata(L, 1, ATLAS_METATABLE);
+    if (!atlas->texture)
+    {
+        return luaL_error(L, "Atlas was never packed");
+    }
+    RetainTexture(atlas->texture);
+    PushTexture(L, atlas->texture);
+    return 1;
+}
+
+// Where an id ended up in the atlas: x, y, width and height
+int atlas_rect(lua_State *L)
+{
+    Atlas *atlas = (Atlas *)luaL_checkudata(L, 1, ATLAS_METATABLE);
+    const AtlasEntry *entry = FindAtlasEntry(atlas, RomImageId(luaL_checkstring(L, 2)));
+    if (!entry)
+    {
+        return luaL_error(L, "Image '%s' is not in the atlas", lua_tostring(L, 2));
+    }
+    lua_pushinteger(L, entry->x);
+    lua_pushinteger(L, entry->y);
+    lua_pushinteger(L, entry->width);
+    lua_pushinteger(L, entry->height);
+    return 4;
+}
+
+int atlas_gc(lua_State *L)
+{
+    Atlas *atlas = (Atlas *)luaL_checkudata(L, 1, ATLAS_METATABLE);
+    if (atlas->texture)
+        ReleaseTexture(atlas->texture);
+    atlas->texture = NULL;
+    return 0;
+}
+
+static int WriteBytecode(lua_State *L, const void *p, size_t size, void *data)
+{
+    (void)L;
+    ShaderWorkers *workers = (ShaderWorkers *)data;
+    if (workers->bytecodeSize + size > workers->bytecodeCapacity)
+    {
+        size_t capacity = workers->bytecodeCapacity ? workers->bytecodeCapacity : 4096;
+        while (workers->bytecodeSize + size > capacity)
+            capacity *= 2;
+        char *grown = (char *)realloc(workers->bytecode, capacity);
+        if (!grown)
+            return 1;
+        workers->bytecode = grown;
+        workers->bytecodeCapacity = capacity;
+    }
+    memcpy(workers->bytecode + workers->bytecodeSize, p, size);
+    workers->bytecodeSize += size;
+    return 0;
+}
+
+// Map every table and C function in the globals, and in the tables they hold, to its name ("math" or "math.floor"),
+// so each upvalue is matched to the workers' own copy with one lookup. Pushes the map
+static void PushLibraryMap(lua_State *L)
+{
+    lua_newtable(L);
+    int map = lua_gettop(L);
+
+    // Fields first so a value that is also a global keeps its global name
+    lua_pushnil(L);
+    while (lua_next(L, LUA_GLOBALSINDEX))
+    {
+        int library = lua_gettop(L);
+        if (lua_type(L, library - 1) == LUA_TSTRING && lua_istable(L, library))
+        {
+            lua_pushnil(L);
+            while (lua_next(L, library))
+            {
+                if (lua_type(L, -2) == LUA_TSTRING && (lua_istable(L, -1) || lua_iscfunction(L, -1)))
+                {
+                    lua_pushfstring(L, "%s.%s", lua_tostring(L, library - 1), lua_tostring(L, -2));
+                    lua_rawset(L, map); // Leaves the key for lua_next
+                    continue;
+                }
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, LUA_GLOBALSINDEX))
+    {
+        if (lua_type(L, -2) == LUA_TSTRING && (lua_istable(L, -1) || lua_iscfunction(L, -1)))
+        {
+            lua_pushvalue(L, -2);
+            lua_rawset(L, map);
+            continue;
+        }
+        lua_pop(L, 1);
+    }
+}
+
+// Push the worker's own copy of a library value by the name PushLibraryMap gave it. Raw lookups, so the
+// workers' missing global check doesn't see them
+static bool PushLibraryValue(const char *path, lua_State *to)
+{
+    const char *dot = strchr(path, '.');
+    lua_pushlstring(to, path, dot ? (size_t)(dot - path) : strlen(path));
+    lua_rawget(to, LUA_GLOBALSINDEX);
+    if (dot)
+    {
+        if (!lua_istable(to, -1))
+        {
+            lua_pop(to, 1);
+            return false;
+        }
+        lua_pushstring(to, dot + 1);
+        lua_rawget(to, -2);
+        lua_remove(to, -2);
+    }
+    if (lua_isnil(to, -1))
+    {
+        lua_pop(to, 1);
+        return false;
+    }
+    return true;
+}
+
+// Copy a value between states, upvalues are snapshotted so the workers only ever read them.
+// libraries is the index of PushLibraryMap's map in from
+static bool CopyLuaValue(lua_State *from, int idx, lua_State *to, int libraries, int depth)
+{
+    if (depth > 16 || !lua_checkstack(to, 4))
+        return false;
+    if (idx < 0)
+        idx = lua_gettop(from) + idx + 1;
+
+    // Libraries and their C functions can't be copied, but every worker state has its own
+    int type = lua_type(from, idx);
+    if (type == LUA_TTABLE || lua_iscfunction(from, idx))
+    {
+        lua_pushvalue(from, idx);
+        lua_rawget(from, libraries);
+        const char *path = lua_tostring(from, -1);
+        bool found = path && PushLibraryValue(path, to);
+        lua_pop(from, 1);
+        if (found)
+            return true;
+    }
+
+    switch (type)
+    {
+    case LUA_TNIL:
+        lua_pushnil(to);
+        return true;
+    case LUA_TBOOLEAN:
+        lua_pushboolean(to, lua_toboolean(from, idx));
+        return true;
+    case LUA_TNUMBER:
+        lua_pushnumber(to, lua_tonumber(from, idx));
+        return true;
+    case LUA_TSTRING:
+    {
+        size_t length;
+        const char *str = lua_tolstring(from, idx, &length);
+        lua_pushlstring(to, str, length);
+        return true;
+    }
+    case LUA_TTABLE:
+        lua_newtable(to);
+        lua_pushnil(from);
+        while (lua_next(from, idx))
+        {
+            if (!CopyLuaValue(from, -2, to, libraries, depth + 1) || !CopyLuaValue(from, -1, to, libraries, depth + 1))
+            {
+                lua_pop(from, 2);
+                return false;
+            }
+            lua_rawset(to, -3);
+            lua_pop(from, 1);
+        }
+        if (lua_getmetatable(from, idx))
+        {
+            bool copied = CopyLuaValue(from, -1, to, libraries, depth + 1);
+            lua_pop(from, 1);
+            if (!copied)
+                return false;
+            lua_setmetatable(to, -2);
+        }
+        return true;
+    case LUA_TFUNCTION:
+    {
+        // Helper functions captured by the shader are dumped and loaded again with their own upvalues
+        if (lua_iscfunction(from, idx))
+            return false;
+        ShaderWorkers dump = {0};
+        lua_pushvalue(from, idx);
+        int failed = lua_dump(from, WriteBytecode, &dump);
+        lua_pop(from, 1);
+        bool loaded = !failed && luaL_loadbuffer(to, dump.bytecode, dump.bytecodeSize, "=shader") == LUA_OK;
+        free(dump.bytecode);
+        if (!loaded)
+            return false;
+        for (int i = 1; lua_getupvalue(from, idx, i); i++)
+        {
+            bool copied = CopyLuaValue(from, -1, to, libraries, depth + 1);
+            lua_pop(from, 1);
+            if (!copied)
+                return false;
+            lua_setupvalue(to, -2, i);
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// Worker globals only hold the libraries, a shader touching any other global has to run on the script's own state
+static int WorkerGlobalIndex(lua_State *L)
+{
+    (void)L;
+    SDL_AtomicSet(&shaderWorkers.missedGlobal, 1);
+    return 0;
+}
+
+static int WorkerGlobalNewIndex(lua_State *L)
+{
+    SDL_AtomicSet(&shaderWorkers.missedGlobal, 1);
+    lua_rawset(L, 1);
+    return 0;
+}
+
+// Random numbers come from one generator on the script's state, a worker drawing its own would repeat the same
+// sequence in every band (and rand() isn't safe across threads), so these redo the call like a missing global
+static int WorkerRandom(lua_State *L)
+{
+    SDL_AtomicSet(&shaderWorkers.missedGlobal, 1);
+    return luaL_error(L, "random numbers only come from the script's state");
+}
+
+static void ReplaceWorkerFunction(lua_State *state, const char *library, const char *name)
+{
+    lua_getfield(state, LUA_GLOBALSINDEX, library);
+    lua_pushcfunction(state, WorkerRandom);
+    lua_setfield(state, -2, name);
+    lua_pop(state, 1);
+}
+
+// Give every worker state the shader function at idx along with a fresh copy of its upvalues
+bool PrepareParallelShader(lua_State *L, int idx)
+{
+    StartWorkerPool();
+    int workers = WorkerCount();
+    if (!shaderWorkers.states)
+    {
+        shaderWorkers.states = (lua_State **)calloc(workers, sizeof(lua_State *));
+        shaderWorkers.functionRefs = (int *)calloc(workers, sizeof(int));
+        shaderWorkers.busySeconds = (double *)calloc(workers, sizeof(double));
+        if (!shaderWorkers.states || !shaderWorkers.functionRefs || !shaderWorkers.busySeconds)
+            return false;
+        for (int i = 0; i < workers; i++)
+        {
+            lua_State *state = luaL_newstate();
+            if (!state)
+                return false;
+            luaL_openlibs(state);
+            RegisterColorLibrary(state);
+            RegisterUtilLibrary(state);
+            ReplaceWorkerFunction(state, "math", "random");
+            ReplaceWorkerFunction(state, "math", "randomseed");
+            ReplaceWorkerFunction(state, "util", "random");
+            lua_pushvalue(state, LUA_GLOBALSINDEX);
+            lua_createtable(state, 0, 2);
+            lua_pushcfunction(state, WorkerGlobalIndex);
+            lua_setfield(state, -2, "__index");
+            lua_pushcfunction(state, WorkerGlobalNewIndex);
+            lua_setfield(state, -2, "__newindex");
+            lua_setmetatable(state, -2);
+            lua_pop(state, 1);
+            shaderWorkers.states[i] = state;
+            shaderWorkers.functionRefs[i] = LUA_NOREF;
+        }
+    }
+
+    // Dumping is cheap next to running the shader, and catches a new closure of the same code
+    char *previous = shaderWorkers.bytecode;
+    size_t previousSize = shaderWorkers.bytecodeSize;
+    shaderWorkers.bytecode = NULL;
+    shaderWorkers.bytecodeSize = 0;
+    shaderWorkers.bytecodeCapacity = 0;
+    lua_pushvalue(L, idx);
+    int failed = lua_dump(L, WriteBytecode, &shaderWorkers);
+    lua_pop(L, 1);
+    if (failed)
+    {
+        free(previous);
+        return false;
+    }
+    bool changed = !previous || previousSize != shaderWorkers.bytecodeSize ||
+                   memcmp(previous, shaderWorkers.bytecode, previousSize) != 0;
+    free(previous);
+    if (changed)
+    {
+        shaderWorkers.failed = false;
+        shaderWorkers.sampledBands = 0;
+        shaderWorkers.sampledSeconds = 0.0;
+    }
+    else if (shaderWorkers.failed)
+        return false;
+
+    if (idx < 0)
+        idx = lua_gettop(L) + idx + 1;
+    PushLibraryMap(L);
+    int libraries = lua_gettop(L);
+    for (int i = 0; i < workers; i++)
+    {
+        lua_State *state = shaderWorkers.states[i];
+        if (changed)
+        {
+            luaL_unref(state, LUA_REGISTRYINDEX, shaderWorkers.functionRefs[i]);
+            shaderWorkers.functionRefs[i] = LUA_NOREF;
+            if (luaL_loadbuffer(state, shaderWorkers.bytecode, shaderWorkers.bytecodeSize, "=shader") != LUA_OK)
+            {
+                LOG("Failed to load parallel shader: %s\n", lua_tostring(state, -1));
+                lua_pop(state, 1);
+                lua_pop(L, 1);
+                shaderWorkers.failed = true;
+                return false;
+            }
+            shaderWorkers.functionRefs[i] = luaL_ref(state, LUA_REGISTRYINDEX);
+        }
+
+        lua_rawgeti(state, LUA_REGISTRYINDEX, shaderWorkers.functionRefs[i]);
+        for (int n = 1; lua_getupvalue(L, idx, n); n++)
+        {
+            bool copied = CopyLuaValue(L, -1, state, libraries, 0);
+            lua_pop(L, 1);
+            if (!copied)
+            {
+                LOG("Shader upvalue %d can't be copied to the workers, running it on one thread\n", n);
+                lua_settop(state, 0);
+                lua_pop(L, 1);
+                shaderWorkers.failed = true;
+                return false;
+            }
+            lua_setupvalue(state, -2, n);
+        }
+        lua_pop(state, 1);
+    }
+    lua_pop(L, 1);
+    return true;
+}
+
+void CloseParallelShader()
+{
+    if (shaderWorkers.states)
+    {
+        for (int i = 0; i < WorkerCount(); i++)
+        {
+            if (shaderWorkers.states[i])
+                lua_close(shaderWorkers.states[i]);
+        }
+    }
+    free(shaderWorkers.states);
+    free(shaderWorkers.functionRefs);
+    free(shaderWorkers.busySeconds);
+    free(shaderWorkers.bytecode);
+    memset(&shaderWorkers, 0, sizeof(shaderWorkers));
+}
+
+typedef struct ShaderBands
+{
+    Canvas canvas;
+    int count;
+} ShaderBands;
+
+// One band of rows, the same per pixel work as the serial path but on the worker's own state
+static void ShaderBandJob(void *context, int job, int worker)
+{
+    const ShaderBands *bands = (const ShaderBands *)context;
+    const Canvas *canvas = &bands->canvas;
+    int startY = job * canvas->maxY / bands->count;
+    int endY = (job + 1) * canvas->maxY / bands->count;
+    lua_State *state = shaderWorkers.states[worker];
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    lua_rawgeti(state, LUA_REGISTRYINDEX, shaderWorkers.functionRefs[worker]);
+    int function = lua_gettop(state);
+    for (int y = startY; y < endY && !SDL_AtomicGet(&shaderWorkers.missedGlobal); y++)
+    {
+        for (int x = 0; x < canvas->maxX; x++)
+        {
+            lua_pushvalue(state, function);
+            lua_pushinteger(state, x);
+            lua_pushinteger(state, y);
+            if (lua_pcall(state, 2, 1, 0) != LUA_OK)
+            {
+                // The error is most likely from the missing global, the main state will report it if not
+                if (SDL_AtomicGet(&shaderWorkers.missedGlobal))
+                {
+                    lua_pop(state, 1);
+                    break;
+                }
+                LOG("Error in Shader: %s\n", lua_tostring(state, -1));
+                lua_pop(state, 1);
+                canvas->pixels[y * canvas->stride + x] = paletteColors[1];
+                continue;
+            }
+            int value = lua_tointeger(state, -1);
+            lua_pop(state, 1);
+
+            if (value < 1 || value > 512)
+            {
+                canvas->pixels[y * canvas->stride + x] = paletteColors[1];
+                continue;
+            }
+            canvas->pixels[y * canvas->stride + x] = paletteColors[value];
+        }
+    }
+    lua_pop(state, 1);
+
+    shaderWorkers.busySeconds[worker] += (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+}
+
+// Run one band of the shader at idx on the script's own state and throw the colors away, returns how long it took
+static double TimeSerialBand(lua_State *L, int idx, const ShaderBands *bands, int job)
+{
+    const Canvas *canvas = &bands->canvas;
+    int startY = job * canvas->maxY / bands->count;
+    int endY = (job + 1) * canvas->maxY / bands->count;
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int y = startY; y < endY; y++)
+    {
+        for (int x = 0; x < canvas->maxX; x++)
+        {
+            lua_pushvalue(L, idx);
+            lua_pushinteger(L, x);
+            lua_pushinteger(L, y);
+            lua_pcall(L, 2, 1, 0); // Errors were already reported by the workers
+            lua_pop(L, 1);
+        }
+    }
+    return (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+}
+
+int drawing_shader(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    FlushDeferred(); // The shader covers the whole buffer, queued primitives go underneath
+    if (!drawTarget)
+        MarkAllDirty();
+    Canvas canvas = TargetCanvas();
+    frameStats.current.shaders++;
+    frameStats.current.pixels += (Uint64)canvas.maxX * canvas.maxY;
+
+    // Several bands per worker keeps the load even when some rows cost more than others
+    if (lua_toboolean(L, 2) && PrepareParallelShader(L, 1))
+    {
+        int workers = WorkerCount();
+        ShaderBands bands = {canvas, workers * 4};
+        if (bands.count > canvas.maxY)
+            bands.count = canvas.maxY;
+
+        for (int i = 0; i < workers; i++)
+            shaderWorkers.busySeconds[i] = 0.0;
+        SDL_AtomicSet(&shaderWorkers.missedGlobal, 0);
+        Uint64 start = SDL_GetPerformanceCounter();
+        RunJobs(ShaderBandJob, &bands, bands.count);
+        if (!SDL_AtomicGet(&shaderWorkers.missedGlobal))
+        {
+            shaderWorkers.wallSeconds = (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+            shaderWorkers.totalBusySeconds = 0.0;
+            for (int i = 0; i < workers; i++)
+                shaderWorkers.totalBusySeconds += shaderWorkers.busySeconds[i];
+
+            // A different band each time, the average of them stands in for the serial time of the whole call
+            if (shaderWorkers.sampledCount != bands.count)
+            {
+                shaderWorkers.sampledCount = bands.count;
+                shaderWorkers.sampledBands = 0;
+                shaderWorkers.sampledSeconds = 0.0;
+            }
+            if (shaderWorkers.calls++ % 16 == 0)
+            {
+                shaderWorkers.sampledSeconds += TimeSerialBand(L, 1, &bands, shaderWorkers.sampledBands % bands.count);
+                shaderWorkers.sampledBands++;
+            }
+            return 0;
+        }
+
+        // Redo the whole canvas on the script's state, and keep this shader there from now on
+        LOG("Shader uses globals or random numbers the workers don't have, running it on one thread\n");
+        shaderWorkers.failed = true;
+    }
+
+    for (int y = 0; y < canvas.maxY; y++)
+    {
+        for (int x = 0; x < canvas.maxX; x++)
+        {
+            lua_pushvalue(L, 1);   // Push the shader function
+            lua_pushinteger(L, x); // Push x
+            lua_pushinteger(L, y); // Push y
+            if (lua_pcall(L, 2, 1, 0) != LUA_OK)
+            {
+                LOG("Error in Shader: %s\n", lua_tostring(L, -1));
+                lua_pop(L, 1);
+                // Set default color as black with full opacity
+                canvas.pixels[y * canvas.stride + x] = paletteColors[1];
+                continue;
+            }
+            int value = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+
+            if (value < 1 || value > 512)
+            {
+                // Set default color as black with full opacity
+                canvas.pixels[y * canvas.stride + x] = paletteColors[1];
+                continue;
+            }
+
+            // Write the palette color to the back buffer
+            canvas.pixels[y * canvas.stride + x] = paletteColors[value];
+        }
+    }
+
+    return 0;
+}
+
+// Blit part of a packed texture, clipping each row once. Opaque textures copy whole rows, others go through the masked kernel.
+// Returns how many pixels it covered
+int BlitTexture(const Canvas *canvas, Texture *tex, int srcX, int srcY, int width, int height, int xOffset, int yOffset)
+{
+    int startX = xOffset < canvas->minX ? canvas->minX - xOffset : 0;
+    int endX = width;
+    if (xOffset + endX > canvas->maxX)
+        endX = canvas->maxX - xOffset;
+    int startY = yOffset < canvas->minY ? canvas->minY - yOffset : 0;
+    int endY = height;
+    if (yOffset + endY > canvas->maxY)
+        endY = canvas->maxY - yOffset;
+    if (startX >= endX || startY >= endY)
+        return 0;
+
+    for (int y = startY; y < endY; y++)
+    {
+        const Uint32 *src = tex->pixels + (srcY + y) * tex->width + srcX;
+        Uint32 *dest = canvas->pixels + (yOffset + y) * canvas->stride + xOffset;
+
+        if (tex->opaque)
+        {
+            memcpy(dest + startX, src + startX, (endX - startX) * sizeof(Uint32));
+            continue;
+        }
+
+        simd.blitSpan(dest + startX, src + startX, endX - startX);
+    }
+    return (endX - startX) * (endY - startY);
+}
+
+// Timing of the last parallel shader, speedup is the estimated time on one thread over the wall time
+int drawing_shaderStats(lua_State *L)
+{
+    double serialSeconds = shaderWorkers.sampledBands > 0
+                               ? shaderWorkers.sampledSeconds / shaderWorkers.sampledBands * shaderWorkers.sampledCount
+                               : 0.0;
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, SDL_GetCPUCount());
+    lua_setfield(L, -2, "cores");
+    lua_pushinteger(L, shaderWorkers.states ? WorkerCount() : 0);
+    lua_setfield(L, -2, "workers");
+    lua_pushnumber(L, shaderWorkers.wallSeconds * 1000.0);
+    lua_setfield(L, -2, "wallMs");
+    lua_pushnumber(L, shaderWorkers.totalBusySeconds * 1000.0);
+    lua_setfield(L, -2, "busyMs");
+    lua_pushnumber(L, serialSeconds * 1000.0);
+    lua_setfield(L, -2, "serialMs");
+    lua_pushnumber(L, shaderWorkers.wallSeconds > 0.0 ? serialSeconds / shaderWorkers.wallSeconds : 0.0);
+    lua_setfield(L, -2, "speedup");
+    return 1;
+}
+
+// Raw back buffer for LuaJIT's FFI, the pointer stays the same for the rest of the run
+int drawing_buffer(lua_State *L)
+{
+    if (!pixelsBack)
+    {
+        return luaL_error(L, "The back buffer doesn't exist yet, call drawing.buffer from update");
+    }
+
+    // Writes through the pointer land straight away, so anything recorded before them goes first
+    FlushDeferred();
+    // The pointer has to outlive the frame, which the locked texture doesn't
+    if (!StopLockedRendering())
+    {
+        return luaL_error(L, "Failed to allocate memory for the back buffer");
+    }
+    backBufferPinned = true;
+    lua_pushlightuserdata(L, pixelsBack);
+    lua_pushinteger(L, bufferWidth); // Stride in pixels
+    lua_pushinteger(L, bufferWidth);
+    lua_pushinteger(L, bufferHeight);
+    return 4;
+}
+
+// Packed pixel for every encoded color, for writing palette indices through drawing.buffer
+int drawing_palette(lua_State *L)
+{
+    lua_pushlightuserdata(L, paletteColors);
+    lua_pushinteger(L, 513);
+    return 2;
+}
+
+int drawing_rect(lua_State *L)
+{
+    int xOffset = luaL_checkinteger(L, 2);
+    int yOffset = luaL_checkinteger(L, 3);
+
+    if (!lua_istable(L, 1))
+    {
+        Texture *tex = CheckTexture(L, 1);
+        luaL_argcheck(L, tex != drawTarget, 1, "can't draw a texture onto itself");
+        SubmitBlit(tex, 0, 0, tex->width, tex->height, xOffset, yOffset);
+        return 0;
+    }
+
+    // Deferred mode and render targets take a packed copy of the table
+    if (deferred.enabled || drawTarget)
+    {
+        lua_pushcfunction(L, texture_fromTable);
+        lua_pushvalue(L, 1);
+        if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+            return 0; // An empty table has nothing to draw
+        Texture *tex = CheckTexture(L, -1);
+        SubmitBlit(tex, 0, 0, tex->width, tex->height, xOffset, yOffset);
+        return 0;
+    }
+
+    // Old style texture made of nested tables
+    int textureHeight = lua_objlen(L, 1); // Updated to lua_objlen
+    int widest = 0;
+    frameStats.current.calls[DRAW_BLIT]++;
+
+    for (int y = 1; y <= textureHeight; y++)
+    {
+        lua_rawgeti(L, 1, y);
+        int textureWidth = lua_objlen(L, -1); // Updated to lua_objlen
+        if (textureWidth > widest)
+            widest = textureWidth;
+
+        for (int x = 1; x <= textureWidth; x++)
+        {
+            lua_rawgeti(L, -1, x);
+            int value = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+
+            int destX = xOffset + x - 1;
+            int destY = yOffset + y - 1;
+
+            if (destX >= 0 && destX < bufferWidth && destY >= 0 && destY < bufferHeight)
+            {
+                if (value <= 0 || value > 512)
+                    continue;
+
+                // Write to the back buffer
+                pixelsBack[destY * bufferStride + destX] = paletteColors[value];
+                frameStats.current.pixels++;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    MarkDirty(xOffset, yOffset, xOffset + widest - 1, yOffset + textureHeight - 1);
+    return 0;
+}
+
+// Draw one image out of an atlas by id, or any rectangle of a texture:
+// drawing.sprite(atlas, id, x, y) or drawing.sprite(tex, srcX, srcY, width, height, x, y)
+int drawing_sprite(lua_State *L)
+{
+    Atlas *atlas = (Atlas *)luaL_testudata(L, 1, ATLAS_METATABLE);
+    if (atlas)
+    {
+        const AtlasEntry *entry = atlas->texture ? FindAtlasEntry(atlas, RomImageId(luaL_checkstring(L, 2))) : NULL;
+        if (!entry)
+        {
+            return luaL_error(L, "Image '%s' is not in the atlas", lua_tostring(L, 2));
+        }
+        luaL_argcheck(L, atlas->texture != drawTarget, 1, "can't draw a texture onto itself");
+        SubmitBlit(atlas->texture, entry->x, entry->y, entry->width, entry->height, luaL_checkinteger(L, 3), luaL_checkinteger(L, 4));
+        return 0;
+    }
+
+    Texture *tex = CheckTexture(L, 1);
+    int srcX = luaL_checkinteger(L, 2);
+    int srcY = luaL_checkinteger(L, 3);
+    int width = luaL_checkinteger(L, 4);
+    int height = luaL_checkinteger(L, 5);
+    luaL_argcheck(L, srcX >= 0 && width >= 0 && srcX + width <= tex->width, 2, "source rectangle outside the texture");
+    luaL_argcheck(L, srcY >= 0 && height >= 0 && srcY + height <= tex->height, 3, "source rectangle outside the texture");
+    luaL_argcheck(L, tex != drawTarget, 1, "can't draw a texture onto itself");
+    SubmitBlit(tex, srcX, srcY, width, height, luaL_checkinteger(L, 6), luaL_checkinteger(L, 7));
+    return 0;
+}
+
+// Grow the back buffer's dirty box by a box clipped to the screen
+void MarkDirty(int minX, int minY, int maxX, int maxY)
+{
+    if (minX < 0)
+        minX = 0;
+    if (minY < 0)
+        minY = 0;
+    if (maxX >= bufferWidth)
+        maxX = bufferWidth - 1;
+    if (maxY >= bufferHeight)
+        maxY = bufferHeight - 1;
+    DirtyRect rect = {minX, minY, maxX, maxY};
+    UniteDirty(&dirtyBack, &rect);
+}
+
+void MarkAllDirty()
+{
+    MarkDirty(0, 0, bufferWidth - 1, bufferHeight - 1);
+}
+
+void UniteDirty(DirtyRect *rect, const DirtyRect *other)
+{
+    if (other->minX > other->maxX || other->minY > other->maxY)
+        return;
+    if (rect->minX > rect->maxX || rect->minY > rect->maxY)
+    {
+        *rect = *other;
+        return;
+    }
+    if (other->minX < rect->minX)
+        rect->minX = other->minX;
+    if (other->minY < rect->minY)
+        rect->minY = other->minY;
+    if (other->maxX > rect->maxX)
+        rect->maxX = other->maxX;
+    if (other->maxY > rect->maxY)
+        rect->maxY = other->maxY;
+}
+
+// Zero the dirty part of a buffer, leaving it clean
+void ClearDirty(Uint32 *pixels, DirtyRect *rect)
+{
+    if (rect->minX <= rect->maxX && rect->minY <= rect->maxY)
+    {
+        int width = rect->maxX - rect->minX + 1;
+        if (width == bufferWidth)
+        {
+            memset(pixels + rect->minY * bufferWidth, 0, (size_t)(rect->maxY - rect->minY + 1) * bufferWidth * sizeof(Uint32));
+        }
+        else
+        {
+            for (int y = rect->minY; y <= rect->maxY; y++)
+                memset(pixels + y * bufferWidth + rect->minX, 0, width * sizeof(Uint32));
+        }
+    }
+    rect->minX = rect->minY = 0;
+    rect->maxX = rect->maxY = -1;
+}
+
+// The whole back buffer
+Canvas ScreenCanvas()
+{
+    Canvas canvas = {pixelsBack, bufferStride, 0, 0, bufferWidth, bufferHeight};
+    return canvas;
+}
+
+// Where primitives go right now, the render target or the screen
+Canvas TargetCanvas()
+{
+    if (!drawTarget)
+        return ScreenCanvas();
+    Canvas canvas = {drawTarget->pixels, drawTarget->width, 0, 0, drawTarget->width, drawTarget->height};
+    return canvas;
+}
+
+static void FillSpanScalar(Uint32 *dest, int count, Uint32 color)
+{
+    for (int i = 0; i < count; i++)
+        dest[i] = color;
+}
+
+static void BlitSpanScalar(Uint32 *dest, const Uint32 *src, int count)
+{
+    int x = 0;
+    while (x < count)
+    {
+        // Skip transparent pixels, then copy the run of visible ones
+        while (x < count && src[x] == 0)
+            x++;
+        int runStart = x;
+        while (x < count && src[x] != 0)
+            x++;
+        if (x > runStart)
+            memcpy(dest + runStart, src + runStart, (x - runStart) * sizeof(Uint32));
+    }
+}
+
+#ifdef PLF_X86
+TARGET_SSE2 static void FillSpanSSE2(Uint32 *dest, int count, Uint32 color)
+{
+    // Single stores up to a 16 byte boundary, then 4 pixels at a time
+    int i = 0;
+    while (i < count && ((uintptr_t)(dest + i) & 15))
+        dest[i++] = color;
+    __m128i value = _mm_set1_epi32((int)color);
+    for (; i + 4 <= count; i += 4)
+        _mm_store_si128((__m128i *)(dest + i), value);
+    for (; i < count; i++)
+        dest[i] = color;
+}
+
+TARGET_SSE2 static void BlitSpanSSE2(Uint32 *dest, const Uint32 *src, int count)
+{
+    // Keep the destination wherever the source is 0, SSE2 has no blend so it's and/or
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i transparent = _mm_cmpeq_epi32(pixels, zero);
+        __m128i under = _mm_and_si128(transparent, _mm_loadu_si128((const __m128i *)(dest + i)));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_or_si128(pixels, under));
+    }
+    for (; i < count; i++)
+    {
+        if (src[i] != 0)
+            dest[i] = src[i];
+    }
+}
+
+TARGET_AVX2 static void FillSpanAVX2(Uint32 *dest, int count, Uint32 color)
+{
+    // Single stores up to a 32 byte boundary, then 16 pixels at a time
+    int i = 0;
+    while (i < count && ((uintptr_t)(dest + i) & 31))
+        dest[i++] = color;
+    __m256i value = _mm256_set1_epi32((int)color);
+    for (; i + 16 <= count; i += 16)
+    {
+        _mm256_store_si256((__m256i *)(dest + i), value);
+        _mm256_store_si256((__m256i *)(dest + i + 8), value);
+    }
+    for (; i + 8 <= count; i += 8)
+        _mm256_store_si256((__m256i *)(dest + i), value);
+    for (; i < count; i++)
+        dest[i] = color;
+}
+TARGET_AVX2 static void BlitSpanAVX2(Uint32 *dest, const Uint32 *src, int count)
+{
+    __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i transparent = _mm256_cmpeq_epi32(pixels, zero);
+        if (_mm256_testc_si256(transparent, _mm256_set1_epi32(-1)))
+            continue; // Nothing visible in these 8
+        __m256i under = _mm256_loadu_si256((const __m256i *)(dest + i));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_blendv_epi8(pixels, under, transparent));
+    }
+    for (; i < count; i++)
+    {
+        if (src[i] != 0)
+            dest[i] = src[i];
+    }
+}
+#endif
+
+// Pick kernels by name ("scalar", "sse2" or "avx2"), or the best the CPU supports when name is NULL.
+// Returns false if the CPU can't run the ones asked for
+bool SelectSimd(const char *name)
+{
+    SimdKernels kernels = {"scalar", FillSpanScalar, BlitSpanScalar};
+#ifdef PLF_X86
+    bool hasSSE2 = SDL_HasSSE2();
+    bool hasAVX2 = SDL_HasAVX2();
+    if (name ? strcmp(name, "avx2") == 0 : hasAVX2)
+    {
+        if (!hasAVX2)
+            return false;
+        kernels.name = "avx2";
+        kernels.fillSpan = FillSpanAVX2;
+        kernels.blitSpan = BlitSpanAVX2;
+    }
+    else if (name ? strcmp(name, "sse2") == 0 : hasSSE2)
+    {
+        if (!hasSSE2)
+            return false;
+        kernels.name = "sse2";
+        kernels.fillSpan = FillSpanSSE2;
+        kernels.blitSpan = BlitSpanSSE2;
+    }
+#endif
+    if (name && strcmp(name, kernels.name) != 0)
+        return false;
+    simd = kernels;
+    return true;
+}
+
+// Fill from x1 to x2 inclusive on row y, clipped to the canvas. Returns how many pixels it filled
+static int FillCanvasSpan(const Canvas *canvas, int y, int x1, int x2, Uint32 color)
+{
+    if (x1 < canvas->minX)
+        x1 = canvas->minX;
+    if (x2 >= canvas->maxX)
+        x2 = canvas->maxX - 1;
+    if (x1 > x2)
+        return 0;
+    simd.fillSpan(canvas->pixels + y * canvas->stride + x1, x2 - x1 + 1, color);
+    return x2 - x1 + 1;
+}
+
+// Largest x with x * x <= value
+static int HalfSpan(long long value)
+{
+    long long x = (long long)sqrt((double)value);
+    while (x * x > value)
+        x--;
+    while ((x + 1) * (x + 1) <= value)
+        x++;
+    return (int)x;
+}
+
+int DrawCircle(const Canvas *canvas, int centerX, int centerY, int radius, Uint32 color)
+{
+    // One span per row, covering the same pixels as x * x + y * y <= radius * radius
+    int startY = canvas->minY - centerY > -radius ? canvas->minY - centerY : -radius;
+    int endY = canvas->maxY - 1 - centerY < radius ? canvas->maxY - 1 - centerY : radius;
+    long long radiusSquared = (long long)radius * radius;
+    int written = 0;
+
+    for (int y = startY; y <= endY; y++)
+    {
+        int halfWidth = HalfSpan(radiusSquared - (long long)y * y);
+        written += FillCanvasSpan(canvas, centerY + y, centerX - halfWidth, centerX + halfWidth, color);
+    }
+    return written;
+}
+
+int DrawFillRect(const Canvas *canvas, int x, int y, int width, int height, Uint32 color)
+{
+    if (width <= 0 || height <= 0)
+        return 0;
+    int startY = y > canvas->minY ? y : canvas->minY;
+    int endY = y + height < canvas->maxY ? y + height : canvas->maxY;
+    int written = 0;
+    for (int row = startY; row < endY; row++)
+        written += FillCanvasSpan(canvas, row, x, x + width - 1, color);
+    return written;
+}
+
+// Bresenham, walked along the major axis one pixel a step. Only the steps inside the canvas are visited: the minor offset
+// at step k is (2 * k * rise + length - 1) / (2 * length), which lands on the same pixels as walking from the start,
+// so a tile only pays for its own part of a long line
+int DrawLine(const Canvas *canvas, int x1, int y1, int x2, int y2, Uint32 color)
+{
+    if (x1 == x2 && y1 == y2)
+        return DrawPixel(canvas, x1, y1, color);
+
+    bool steep = abs(y2 - y1) > abs(x2 - x1);
+    int major1 = steep ? y1 : x1;
+    int minor1 = steep ? x1 : y1;
+    int majorStep = (steep ? y1 < y2 : x1 < x2) ? 1 : -1;
+    int minorStep = (steep ? x1 < x2 : y1 < y2) ? 1 : -1;
+    long long length = steep ? abs(y2 - y1) : abs(x2 - x1);
+    long long rise = steep ? abs(x2 - x1) : abs(y2 - y1);
+    int majorMin = steep ? canvas->minY : canvas->minX;
+    int majorMax = steep ? canvas->maxY : canvas->maxX;
+    int minorMin = steep ? canvas->minX : canvas->minY;
+    int minorMax = steep ? canvas->maxX : canvas->maxY;
+
+    long long first = majorStep > 0 ? (long long)majorMin - major1 : (long long)major1 - (majorMax - 1);
+    long long last = majorStep > 0 ? (long long)majorMax - 1 - major1 : (long long)major1 - majorMin;
+    if (first < 0)
+        first = 0;
+    if (last > length)
+        last = length;
+
+    long long denominator = 2 * length;
+    long long numerator = 2 * first * rise + length - 1;
+    long long offset = numerator / denominator;
+    long long remainder = numerator % denominator;
+    int written = 0;
+
+    for (long long k = first; k <= last; k++)
+    {
+        long long minor = minor1 + minorStep * offset;
+        if (minor >= minorMin && minor < minorMax)
+        {
+            int major = major1 + majorStep * (int)k;
+            int x = steep ? (int)minor : major;
+            int y = steep ? major : (int)minor;
+            // Write to the back buffer
+            canvas->pixels[y * canvas->stride + x] = color;
+            written++;
+        }
+        else if ((minorStep > 0) == (minor >= minorMax))
+        {
+            break; // Past the canvas and only moving further away
+        }
+        remainder += 2 * rise;
+        if (remainder >= denominator)
+        {
+            remainder -= denominator;
+            offset++;
+        }
+    }
+    return written;
+}
+
+int DrawPixel(const Canvas *canvas, int x, int y, Uint32 color)
+{
+    if (x >= canvas->minX && x < canvas->maxX && y >= canvas->minY && y < canvas->maxY)
+    {
+        // Write to the back buffer
+        canvas->pixels[y * canvas->stride + x] = color;
+        return 1;
+    }
+    return 0;
+}
+
+// Make sure the queue and the tile bins can take one more command, the tile grid follows the buffer size
+static bool ReserveDeferred()
+{
+    int tilesX = (bufferWidth + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (bufferHeight + TILE_SIZE - 1) / TILE_SIZE;
+    if (!deferred.tiles || deferred.tilesX != tilesX || deferred.tilesY != tilesY)
+    {
+        FlushDeferred();
+        for (int i = 0; i < deferred.tilesX * deferred.tilesY; i++)
+            free(deferred.tiles[i].commands);
+        free(deferred.tiles);
+        deferred.tiles = (TileBin *)calloc((size_t)tilesX * tilesY, sizeof(TileBin));
+        deferred.tilesX = deferred.tiles ? tilesX : 0;
+        deferred.tilesY = deferred.tiles ? tilesY : 0;
+        if (!deferred.tiles)
+            return false;
+    }
+
+    if (deferred.commandCount == deferred.commandCapacity)
+    {
+        int capacity = deferred.commandCapacity ? deferred.commandCapacity * 2 : 1024;
+        DrawCommand *commands = (DrawCommand *)realloc(deferred.commands, (size_t)capacity * sizeof(DrawCommand));
+        if (!commands)
+            return false;
+        deferred.commands = commands;
+        deferred.commandCapacity = capacity;
+    }
+    return true;
+}
+
+// Queue a command and add it to every tile its bounding box touches, commands that miss the screen are dropped.
+// Returns false when it couldn't be queued and has to be drawn straight away
+static bool RecordCommand(const DrawCommand *command, int minX, int minY, int maxX, int maxY)
+{
+    if (!deferred.enabled || !pixelsBack)
+        return false;
+    if (maxX < 0 || maxY < 0 || minX >= bufferWidth || minY >= bufferHeight || minX > maxX || minY > maxY)
+        return true;
+    if (!ReserveDeferred())
+    {
+        FlushDeferred();
+        return false;
+    }
+
+    int tileStartX = minX < 0 ? 0 : minX / TILE_SIZE;
+    int tileStartY = minY < 0 ? 0 : minY / TILE_SIZE;
+    int tileEndX = maxX >= bufferWidth ? deferred.tilesX - 1 : maxX / TILE_SIZE;
+    int tileEndY = maxY >= bufferHeight ? deferred.tilesY - 1 : maxY / TILE_SIZE;
+    int index = deferred.commandCount;
+
+    for (int ty = tileStartY; ty <= tileEndY; ty++)
+    {
+        for (int tx = tileStartX; tx <= tileEndX; tx++)
+        {
+            TileBin *bin = &deferred.tiles[ty * deferred.tilesX + tx];
+            if (bin->count == bin->capacity)
+            {
+                int capacity = bin->capacity ? bin->capacity * 2 : 64;
+                int *commands = (int *)realloc(bin->commands, (size_t)capacity * sizeof(int));
+                if (!commands)
+                {
+                    // Drop the tiles already binned for this command and draw it now instead
+                    for (int i = 0; i < deferred.tilesX * deferred.tilesY; i++)
+                    {
+                        TileBin *other = &deferred.tiles[i];
+                        if (other->count > 0 && other->commands[other->count - 1] == index)
+                            other->count--;
+                    }
+                    FlushDeferred();
+                    return false;
+                }
+                bin->commands = commands;
+                bin->capacity = capacity;
+            }
+            bin->commands[bin->count++] = index;
+        }
+    }
+
+    deferred.commands[index] = *command;
+    if (command->texture)
+        RetainTexture(command->texture);
+    deferred.commandCount++;
+    return true;
+}
+
+// Returns how many pixels the command wrote
+static int ExecuteCommand(const Canvas *canvas, const DrawCommand *command)
+{
+    const int *args = command->args;
+    switch (command->type)
+    {
+    case DRAW_PIXEL:
+        return DrawPixel(canvas, args[0], args[1], command->color);
+    case DRAW_LINE:
+        return DrawLine(canvas, args[0], args[1], args[2], args[3], command->color);
+    case DRAW_CIRCLE:
+        return DrawCircle(canvas, args[0], args[1], args[2], command->color);
+    case DRAW_FILL_RECT:
+        return DrawFillRect(canvas, args[0], args[1], args[2], args[3], command->color);
+    case DRAW_BLIT:
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        int pixels = BlitTexture(canvas, command->texture, args[2], args[3], args[4], args[5], args[0], args[1]);
+        SDL_AtomicAdd(&command->texture->pendingTicks, (int)(SDL_GetPerformanceCounter() - start));
+        SDL_AtomicAdd(&command->texture->pendingPixels, pixels);
+        return pixels;
+    }
+    }
+    return 0;
+}
+
+// Move what the workers measured into the texture's totals, on the main thread once per draw
+static void CollectBlitStats(Texture *tex)
+{
+    tex->blitCount++;
+    tex->blitTicks += (Uint32)SDL_AtomicSet(&tex->pendingTicks, 0);
+    tex->blitPixels += (Uint32)SDL_AtomicSet(&tex->pendingPixels, 0);
+}
+
+// Draw a command now, or queue it in deferred mode. The box is what it may touch, max inclusive
+static void SubmitCommand(const DrawCommand *command, int minX, int minY, int maxX, int maxY)
+{
+    frameStats.current.calls[command->type]++;
+    if (!drawTarget)
+    {
+        MarkDirty(minX, minY, maxX, maxY);
+        if (RecordCommand(command, minX, minY, maxX, maxY))
+            return;
+    }
+    Canvas canvas = TargetCanvas();
+    frameStats.current.pixels += ExecuteCommand(&canvas, command);
+    if (command->texture)
+        CollectBlitStats(command->texture);
+}
+
+void SubmitBlit(Texture *tex, int srcX, int srcY, int width, int height, int xOffset, int yOffset)
+{
+    DrawCommand command = {DRAW_BLIT, {xOffset, yOffset, srcX, srcY, width, height}, 0, tex};
+    SubmitCommand(&command, xOffset, yOffset, xOffset + width - 1, yOffset + height - 1);
+}
+
+void SubmitCircle(int centerX, int centerY, int radius, Uint32 color)
+{
+    DrawCommand command = {DRAW_CIRCLE, {centerX, centerY, radius}, color, NULL};
+    SubmitCommand(&command, centerX - radius, centerY - radius, centerX + radius, centerY + radius);
+}
+
+void SubmitLine(int x1, int y1, int x2, int y2, Uint32 color)
+{
+    DrawCommand command = {DRAW_LINE, {x1, y1, x2, y2}, color, NULL};
+    SubmitCommand(&command, x1 < x2 ? x1 : x2, y1 < y2 ? y1 : y2, x1 > x2 ? x1 : x2, y1 > y2 ? y1 : y2);
+}
+
+void SubmitPixel(int x, int y, Uint32 color)
+{
+    DrawCommand command = {DRAW_PIXEL, {x, y}, color, NULL};
+    SubmitCommand(&command, x, y, x, y);
+}
+
+void SubmitFillRect(int x, int y, int width, int height, Uint32 color)
+{
+    DrawCommand command = {DRAW_FILL_RECT, {x, y, width, height}, color, NULL};
+    SubmitCommand(&command, x, y, x + width - 1, y + height - 1);
+}
+
+// Replay one tile's commands clipped to the tile, tiles never share pixels so they can run on any worker
+static void DeferredTileJob(void *context, int job, int worker)
+{
+    (void)context;
+    (void)worker;
+    TileBin *bin = &deferred.tiles[job];
+    if (bin->count == 0)
+        return;
+
+    Canvas canvas = ScreenCanvas();
+    canvas.minX = (job % deferred.tilesX) * TILE_SIZE;
+    canvas.minY = (job / deferred.tilesX) * TILE_SIZE;
+    canvas.maxX = canvas.minX + TILE_SIZE < bufferWidth ? canvas.minX + TILE_SIZE : bufferWidth;
+    canvas.maxY = canvas.minY + TILE_SIZE < bufferHeight ? canvas.minY + TILE_SIZE : bufferHeight;
+
+    int written = 0;
+    for (int i = 0; i < bin->count; i++)
+        written += ExecuteCommand(&canvas, &deferred.commands[bin->commands[i]]);
+    bin->count = 0;
+    SDL_AtomicAdd(&frameStats.tilePixels, written);
+}
+
+// Rasterize everything recorded so far into the back buffer
+void FlushDeferred()
+{
+    if (deferred.commandCount == 0)
+        return;
+
+    RunJobs(DeferredTileJob, NULL, deferred.tilesX * deferred.tilesY);
+    for (int i = 0; i < deferred.commandCount; i++)
+    {
+        if (deferred.commands[i].texture)
+        {
+            CollectBlitStats(deferred.commands[i].texture);
+            ReleaseTexture(deferred.commands[i].texture);
+        }
+    }
+    deferred.commandCount = 0;
+}
+
+void FreeDeferred()
+{
+    FlushDeferred();
+    for (int i = 0; i < deferred.tilesX * deferred.tilesY; i++)
+        free(deferred.tiles[i].commands);
+    free(deferred.tiles);
+    free(deferred.commands);
+    memset(&deferred, 0, sizeof(deferred));
+}
+
+int drawing_circle(lua_State *L)
+{
+    int centerX = luaL_checkinteger(L, 1);
+    int centerY = luaL_checkinteger(L, 2);
+    int radius = luaL_checkinteger(L, 3);
+    int color = luaL_checkinteger(L, 4);
+
+    SubmitCircle(centerX, centerY, radius, DecodeColor(color));
+    return 0;
+}
+
+int drawing_line(lua_State *L)
+{
+    int x1 = luaL_checkinteger(L, 1);
+    int y1 = luaL_checkinteger(L, 2);
+    int x2 = luaL_checkinteger(L, 3);
+    int y2 = luaL_checkinteger(L, 4);
+    int color = luaL_checkinteger(L, 5);
+
+    SubmitLine(x1, y1, x2, y2, DecodeColor(color));
+    return 0;
+}
+
+int drawing_pixel(lua_State *L)
+{
+    int x = luaL_checkinteger(L, 1);
+    int y = luaL_checkinteger(L, 2);
+    int color = luaL_checkinteger(L, 3);
+
+    SubmitPixel(x, y, DecodeColor(color));
+    return 0;
+}
+
+int drawing_fillRect(lua_State *L)
+{
+    int x = luaL_checkinteger(L, 1);
+    int y = luaL_checkinteger(L, 2);
+    int width = luaL_checkinteger(L, 3);
+    int height = luaL_checkinteger(L, 4);
+    int color = luaL_checkinteger(L, 5);
+
+    SubmitFillRect(x, y, width, height, DecodeColor(color));
+    return 0;
+}
+
+// Report the vector kernels in use for fills and blits, or switch to "scalar", "sse2" or "avx2" for comparing them
+int drawing_simd(lua_State *L)
+{
+    if (!lua_isnoneornil(L, 1))
+    {
+        const char *name = luaL_checkstring(L, 1);
+        if (!SelectSimd(name))
+        {
+            return luaL_error(L, "SIMD kernels '%s' aren't supported on this CPU", name);
+        }
+    }
+    lua_pushstring(L, simd.name);
+    return 1;
+}
+
+static int BatchArgumentCount(int op)
+{
+    switch (op)
+    {
+    case BATCH_PIXEL:
+        return 3;
+    case BATCH_LINE:
+        return 5;
+    case BATCH_CIRCLE:
+        return 4;
+    case BATCH_FILL_RECT:
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+static void RunBatchCommand(int op, const int *args)
+{
+    switch (op)
+    {
+    case BATCH_PIXEL:
+        SubmitPixel(args[0], args[1], DecodeColor(args[2]));
+        break;
+    case BATCH_LINE:
+        SubmitLine(args[0], args[1], args[2], args[3], DecodeColor(args[4]));
+        break;
+    case BATCH_CIRCLE:
+        SubmitCircle(args[0], args[1], args[2], DecodeColor(args[3]));
+        break;
+    case BATCH_FILL_RECT:
+        SubmitFillRect(args[0], args[1], args[2], args[3], DecodeColor(args[4]));
+        break;
+    }
+}
+
+// Draw a flat array of commands in one call, each one is an op from drawing.ops followed by its arguments.
+// The commands come from a command buffer, read straight from memory, or a plain table
+int drawing_batch(lua_State *L)
+{
+    CommandBuffer *buffer = (CommandBuffer *)luaL_testudata(L, 1, BATCH_METATABLE);
+    if (!buffer)
+        luaL_checktype(L, 1, LUA_TTABLE);
+    int count = luaL_optinteger(L, 2, buffer ? buffer->capacity : (int)lua_objlen(L, 1));
+    if (buffer)
+        luaL_argcheck(L, count >= 0 && count <= buffer->capacity, 2, "count is larger than the command buffer");
+
+    int args[5];
+    int i = 0;
+    while (i < count)
+    {
+        int op;
+        if (buffer)
+        {
+            op = buffer->commands[i];
+        }
+        else
+        {
+            lua_rawgeti(L, 1, i + 1);
+            op = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+        }
+
+        int argCount = BatchArgumentCount(op);
+        if (argCount < 0)
+        {
+            return luaL_error(L, "Unknown batch command %d at index %d", op, i + 1);
+        }
+        if (i + argCount >= count)
+        {
+            return luaL_error(L, "Batch command at index %d is missing arguments", i + 1);
+        }
+
+        if (buffer)
+        {
+            for (int n = 0; n < argCount; n++)
+                args[n] = buffer->commands[i + 1 + n];
+        }
+        else
+        {
+            for (int n = 0; n < argCount; n++)
+            {
+                lua_rawgeti(L, 1, i + 2 + n);
+                args[n] = lua_tointeger(L, -1);
+                lua_pop(L, 1);
+            }
+        }
+        i += argCount + 1;
+
+        RunBatchCommand(op, args);
+    }
+    return 0;
+}
+
+int drawing_newBatch(lua_State *L)
+{
+    int capacity = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, capacity > 0, 1, "capacity must be positive");
+
+    CommandBuffer *buffer = (CommandBuffer *)lua_newuserdata(L, sizeof(CommandBuffer) + (size_t)capacity * sizeof(Sint32));
+    buffer->capacity = capacity;
+    memset(buffer->commands, 0, (size_t)capacity * sizeof(Sint32));
+    luaL_getmetatable(L, BATCH_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+// Switch deferred mode, primitives are then queued and drawn by tile across the worker pool at the end of the frame.
+// Returns whether it was on before
+int drawing_deferred(lua_State *L)
+{
+    bool wasEnabled = deferred.enabled;
+    if (!lua_isnoneornil(L, 1))
+    {
+        if (!lua_toboolean(L, 1))
+            FlushDeferred();
+        deferred.enabled = lua_toboolean(L, 1);
+    }
+    lua_pushboolean(L, wasEnabled);
+    return 1;
+}
+
+// Draw everything queued in deferred mode now
+int drawing_flush(lua_State *L)
+{
+    (void)L;
+    FlushDeferred();
+    return 0;
+}
+
+// Switch persistent mode, the canvas then keeps what was drawn until it's cleared. Returns whether it was on before
+int drawing_persistent(lua_State *L)
+{
+    bool wasEnabled = persistentCanvas;
+    if (!lua_isnoneornil(L, 1))
+    {
+        bool enable = lua_toboolean(L, 1);
+        // The locked texture doesn't keep its contents between frames
+        if (enable && !StopLockedRendering())
+        {
+            return luaL_error(L, "Failed to allocate memory for the back buffer");
+        }
+        // Leaving, the next swap has to clear everything that built up
+        if (wasEnabled && !enable)
+            MarkAllDirty();
+        persistentCanvas = enable;
+    }
+    lua_pushboolean(L, wasEnabled);
+    return 1;
+}
+
+// Fill the whole canvas or render target with a color, or make it transparent again with no color
+int drawing_clear(lua_State *L)
+{
+    int color = luaL_optinteger(L, 1, 0);
+    Canvas canvas = TargetCanvas();
+    SubmitFillRect(0, 0, canvas.maxX, canvas.maxY, color == 0 ? 0 : DecodeColor(color));
+    return 0;
+}
+
+// Send every primitive into a texture until the end of the frame, or back to the screen with no texture
+int drawing_target(lua_State *L)
+{
+    Texture *tex = lua_isnoneornil(L, 1) ? NULL : CheckWritableTexture(L, 1);
+    // Queued blits have to read the texture before it gets drawn over
+    FlushDeferred();
+    if (drawTarget)
+    {
+        UpdateTextureOpacity(drawTarget);
+        ReleaseTexture(drawTarget);
+    }
+    drawTarget = tex;
+    if (tex)
+        RetainTexture(tex);
+    return 0;
+}
+
+// Pointer to the int32 commands, valid for as long as the command buffer is alive
+int batch_pointer(lua_State *L)
+{
+    CommandBuffer *buffer = (CommandBuffer *)luaL_checkudata(L, 1, BATCH_METATABLE);
+    lua_pushlightuserdata(L, buffer->commands);
+    return 1;
+}
+
+int batch_capacity(lua_State *L)
+{
+    CommandBuffer *buffer = (CommandBuffer *)luaL_checkudata(L, 1, BATCH_METATABLE);
+    lua_pushinteger(L, buffer->capacity);
+    return 1;
+}
+
+// Write values starting at a 1 based index, for filling the buffer without the FFI
+int batch_set(lua_State *L)
+{
+    CommandBuffer *buffer = (CommandBuffer *)luaL_checkudata(L, 1, BATCH_METATABLE);
+    int index = luaL_checkinteger(L, 2);
+    int last = lua_gettop(L);
+    luaL_argcheck(L, index >= 1 && index + (last - 3) <= buffer->capacity, 2, "index out of range");
+
+    for (int arg = 3; arg <= last; arg++)
+        buffer->commands[index - 1 + arg - 3] = luaL_checkinteger(L, arg);
+    return 0;
+}
+
+void CenterMouse()
+{
+    int windowWidth, windowHeight;
+    SDL_GetWindowSize(window, &windowWidth, &windowHeight);
+    SDL_WarpMouseInWindow(window, windowWidth / 2, windowHeight / 2);
+}
+
+// Window calls from Lua go through the main thread when pipelined, see Pipeline
+int mouse_center(lua_State *L)
+{
+    if (!window)
+        return 0;
+    if (pipelined)
+    {
+        SDL_LockMutex(pipeline.lock);
+        pipeline.centerMouse = true;
+        SDL_UnlockMutex(pipeline.lock);
+        WakeMainThread();
+        return 0;
+    }
+    CenterMouse();
+    return 0;
+}
+
+int mouse_visible(lua_State *L)
+{
+    bool visible = lua_toboolean(L, 1);
+    if (!window)
+        return 0;
+    if (pipelined)
+    {
+        SDL_LockMutex(pipeline.lock);
+        pipeline.cursor = visible;
+        SDL_UnlockMutex(pipeline.lock);
+        WakeMainThread();
+        return 0;
+    }
+    SDL_ShowCursor(visible ? SDL_ENABLE : SDL_DISABLE);
+    return 0;
+}
+
+void ShowMessage(const char *text)
+{
+    const char *title = SDL_GetWindowTitle(window);
+
+    SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_INFORMATION, title, text, window);
+}
+
+int window_message(lua_State *L)
+{
+    const char *text = luaL_checkstring(L, 1);
+    if (!window)
+    {
+        // Nobody to show it to, it goes to the console instead
+        LOG("Message: %s\n", text);
+        return 0;
+    }
+    if (pipelined)
+    {
+        // Blocks like it does on the main thread, text stays on the stack until it's shown
+        SDL_LockMutex(pipeline.lock);
+        pipeline.message = text;
+        WakeMainThread();
+        while (pipeline.message)
+            SDL_CondWait(pipeline.changed, pipeline.lock);
+        SDL_UnlockMutex(pipeline.lock);
+        return 0;
+    }
+    ShowMessage(text);
+    return 0;
+}
+
+// Frame times over the last few seconds of presents in ms, deviation is how much they wobble
+int window_frameStats(lua_State *L)
+{
+    double sum = 0.0, minimum = 0.0, maximum = 0.0;
+    for (int i = 0; i < pacer.sampleCount; i++)
+    {
+        double sample = pacer.samples[i];
+        sum += sample;
+        if (i == 0 || sample < minimum)
+            minimum = sample;
+        if (sample > maximum)
+            maximum = sample;
+    }
+    double mean = pacer.sampleCount > 0 ? sum / pacer.sampleCount : 0.0;
+    double variance = 0.0;
+    for (int i = 0; i < pacer.sampleCount; i++)
+        variance += (pacer.samples[i] - mean) * (pacer.samples[i] - mean);
+    if (pacer.sampleCount > 0)
+        variance /= pacer.sampleCount;
+
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, pacer.sampleCount);
+    lua_setfield(L, -2, "frames");
+    lua_pushnumber(L, mean * 1000.0);
+    lua_setfield(L, -2, "mean");
+    lua_pushnumber(L, sqrt(variance) * 1000.0);
+    lua_setfield(L, -2, "deviation");
+    lua_pushnumber(L, minimum * 1000.0);
+    lua_setfield(L, -2, "min");
+    lua_pushnumber(L, maximum * 1000.0);
+    lua_setfield(L, -2, "max");
+    lua_pushnumber(L, mean > 0.0 ? 1.0 / mean : 0.0);
+    lua_setfield(L, -2, "fps");
+    return 1;
+}
+
+static int CompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Push {mean, p50, p95, p99, max} for values, sorting them in the process
+static void PushPercentiles(lua_State *L, double *values, int count)
+{
+    static const struct
+    {
+        const char *name;
+        double rank;
+    } ranks[] = {{"p50", 0.50}, {"p95", 0.95}, {"p99", 0.99}, {"max", 1.0}};
+
+    double sum = 0.0;
+    for (int i = 0; i < count; i++)
+        sum += values[i];
+    qsort(values, count, sizeof(double), CompareDoubles);
+
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, count > 0 ? sum / count : 0.0);
+    lua_setfield(L, -2, "mean");
+    for (size_t i = 0; i < sizeof(ranks) / sizeof(ranks[0]); i++)
+    {
+        // Nearest rank, so p99 of fewer than 100 frames is the slowest one
+        int index = (int)ceil(ranks[i].rank * count) - 1;
+        lua_pushnumber(L, count > 0 ? values[index < 0 ? 0 : index] : 0.0);
+        lua_setfield(L, -2, ranks[i].name);
+    }
+}
+
+// Phase times in ms, pixels and Lua memory in KB as {mean, p50, p95, p99, max} over the last FRAME_SAMPLES frames,
+// plus the average calls per frame of each drawing primitive
+int debug_stats(lua_State *L)
+{
+    static const char *phaseNames[PHASE_COUNT] = {"events", "update", "swap", "upload", "present", "pace"};
+    static const char *drawNames[DRAW_TYPE_COUNT] = {"pixel", "line", "circle", "fillRect", "blit"};
+    double values[FRAME_SAMPLES];
+    int count = frameStats.sampleCount;
+
+    lua_createtable(L, 0, PHASE_COUNT + 6);
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, "frames");
+
+    // Present to present, the same samples window.frameStats uses
+    for (int i = 0; i < pacer.sampleCount; i++)
+        values[i] = pacer.samples[i] * 1000.0;
+    PushPercentiles(L, values, pacer.sampleCount);
+    lua_setfield(L, -2, "frame");
+
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        for (int i = 0; i < count; i++)
+            values[i] = frameStats.samples[i].phases[phase] * 1000.0;
+        PushPercentiles(L, values, count);
+        lua_setfield(L, -2, phaseNames[phase]);
+    }
+
+    for (int i = 0; i < frameStats.latencyCount; i++)
+        values[i] = frameStats.latencies[i] * 1000.0;
+    PushPercentiles(L, values, frameStats.latencyCount);
+    lua_setfield(L, -2, "latency");
+
+    for (int i = 0; i < count; i++)
+        values[i] = (double)frameStats.samples[i].pixels;
+    PushPercentiles(L, values, count);
+    lua_setfield(L, -2, "pixels");
+
+    for (int i = 0; i < count; i++)
+        values[i] = frameStats.samples[i].luaKilobytes;
+    PushPercentiles(L, values, count);
+    lua_setfield(L, -2, "memory");
+
+    lua_createtable(L, 0, DRAW_TYPE_COUNT + 1);
+    for (int type = 0; type < DRAW_TYPE_COUNT; type++)
+    {
+        double calls = 0.0;
+        for (int i = 0; i < count; i++)
+            calls += frameStats.samples[i].calls[type];
+        lua_pushnumber(L, count > 0 ? calls / count : 0.0);
+        lua_setfield(L, -2, drawNames[type]);
+    }
+    double shaders = 0.0;
+    for (int i = 0; i < count; i++)
+        shaders += frameStats.samples[i].shaders;
+    lua_pushnumber(L, count > 0 ? shaders / count : 0.0);
+    lua_setfield(L, -2, "shader");
+    lua_setfield(L, -2, "calls");
+    return 1;
+}
+
+// Turn the stats overlay on or off, returns whether it was on
+int debug_overlay(lua_State *L)
+{
+    bool wasOn = frameStats.overlay;
+    if (!lua_isnone(L, 1))
+        frameStats.overlay = lua_toboolean(L, 1);
+    lua_pushboolean(L, wasOn);
+    return 1;
+}
+
+// profiler.start(intervalMs) starts sampling the main Lua state (every 1ms by default) and forgets the last run
+int profiler_start(lua_State *L)
+{
+    int interval = (int)luaL_optinteger(L, 1, 1);
+    luaL_argcheck(L, interval > 0, 1, "interval must be at least 1ms");
+    lua_pushboolean(L, StartProfiler(interval));
+    return 1;
+}
+
+int profiler_stop(lua_State *L)
+{
+    StopProfiler();
+    lua_pushinteger(L, profiler.samples);
+    return 1;
+}
+
+int profiler_running(lua_State *L)
+{
+    lua_pushboolean(L, profiler.running);
+    return 1;
+}
+
+// The samples so far as collapsed stacks, one "frame;frame;frame count" line each
+int profiler_report(lua_State *L)
+{
+    luaL_Buffer buffer;
+    luaL_buffinit(L, &buffer);
+    ProfileStack **sorted = (ProfileStack **)malloc((profiler.count + 1) * sizeof(ProfileStack *));
+    if (!sorted)
+        return luaL_error(L, "Out of memory");
+    int count = 0;
+    for (int i = 0; i < profiler.capacity; i++)
+    {
+        if (profiler.stacks[i].stack)
+            sorted[count++] = &profiler.stacks[i];
+    }
+    qsort(sorted, count, sizeof(ProfileStack *), CompareProfileStacks);
+    for (int i = 0; i < count; i++)
+    {
+        char line[32];
+        luaL_addstring(&buffer, sorted[i]->stack);
+        snprintf(line, sizeof(line), " %d\n", sorted[i]->count);
+        luaL_addstring(&buffer, line);
+    }
+    free(sorted);
+    luaL_pushresult(&buffer);
+    return 1;
+}
+
+int profiler_save(lua_State *L)
+{
+    const char *path = luaL_optstring(L, 1, PROFILE_FILE);
+    if (!SaveProfile(path))
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Failed to write %s", path);
+        return 2;
+    }
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// trace.start() records from now on, dropping the last trace
+int trace_start(lua_State *L)
+{
+    lua_pushboolean(L, StartTrace());
+    return 1;
+}
+
+int trace_stop(lua_State *L)
+{
+    (void)L;
+    StopTrace();
+    return 0;
+}
+
+int trace_recording(lua_State *L)
+{
+    lua_pushboolean(L, tracer.recording);
+    return 1;
+}
+
+// trace.begin(name) opens a zone for the next trace.finish(), zones nest and only keep the first TRACE_NAME_SIZE - 1
+// characters of the name. They're tracked even when not recording so a trace can start in the middle of one
+int trace_begin(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    if (tracer.depth == TRACE_DEPTH)
+        return luaL_error(L, "Too many open trace zones (at most %d)", TRACE_DEPTH);
+    snprintf(tracer.zoneNames[tracer.depth], TRACE_NAME_SIZE, "%s", name);
+    tracer.zoneStarts[tracer.depth] = SDL_GetPerformanceCounter();
+    tracer.depth++;
+    return 0;
+}
+
+int trace_finish(lua_State *L)
+{
+    if (tracer.depth == 0)
+        return luaL_error(L, "trace.finish without trace.begin");
+    tracer.depth--;
+    if (tracer.recording)
+        TraceZone(tracer.zoneNames[tracer.depth], "lua", TRACE_LOOP, tracer.zoneStarts[tracer.depth], SDL_GetPerformanceCounter());
+    return 0;
+}
+
+int trace_save(lua_State *L)
+{
+    const char *path = luaL_optstring(L, 1, TRACE_FILE);
+    if (!tracer.events)
+        return luaL_error(L, "Nothing has been traced");
+    if (!SaveTrace(path))
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Failed to write %s", path);
+        return 2;
+    }
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+int http_get(lua_State *L)
+{
+    // Implement a cross-platform HTTP GET request if necessary
+    lua_pushnil(L);
+    lua_pushinteger(L, 501); // Not Implemented
+    return 2;
+}
+
+int util_distance(lua_State *L)
+{
+    double x1 = luaL_checknumber(L, 1);
+    double y1 = luaL_checknumber(L, 2);
+    double x2 = luaL_checknumber(L, 3);
+    double y2 = luaL_checknumber(L, 4);
+
+    double dx = x2 - x1;
+    double dy = y2 - y1;
+    double distance = sqrt(dx * dx + dy * dy);
+
+    lua_pushnumber(L, distance);
+    return 1;
+}
+
+int util_random(lua_State *L)
+{
+    int argc = lua_gettop(L);
+    if (argc == 0)
+    {
+        lua_pushnumber(L, (double)rand() / RAND_MAX);
+    }
+    else if (argc == 2)
+    {
+        double min = luaL_checknumber(L, 1);
+        double max = luaL_checknumber(L, 2);
+        double random = min + ((double)rand() / RAND_MAX) * (max - min);
+        lua_pushnumber(L, random);
+    }
+    else
+    {
+        return luaL_error(L, "Invalid arguments to util.random");
+    }
+    return 1;
+}
+
+int util_clamp(lua_State *L)
+{
+    double value = luaL_checknumber(L, 1);
+    double minVal = luaL_checknumber(L, 2);
+    double maxVal = luaL_checknumber(L, 3);
+
+    if (value < minVal)
+        value = minVal;
+    else if (value > maxVal)
+        value = maxVal;
+
+    lua_pushnumber(L, value);
+    return 1;
+}
+
+int util_lerp(lua_State *L)
+{
+    double start = luaL_checknumber(L, 1);
+    double end = luaL_checknumber(L, 2);
+    double t = luaL_checknumber(L, 3);
+
+    double result = start + t * (end - start);
+    lua_pushnumber(L, result);
+    return 1;
+}
+
+int util_intersect(lua_State *L)
+{
+    double x1 = luaL_checknumber(L, 1);
+    double y1 = luaL_checknumber(L, 2);
+    double width1 = luaL_checknumber(L, 3);
+    double height1 = luaL_checknumber(L, 4);
+
+    double x2 = luaL_checknumber(L, 5);
+    double y2 = luaL_checknumber(L, 6);
+    double width2 = luaL_checknumber(L, 7);
+    double height2 = luaL_checknumber(L, 8);
+
+    double halfWidth1 = width1 / 2.0;
+    double halfHeight1 = height1 / 2.0;
+    double halfWidth2 = width2 / 2.0;
+    double halfHeight2 = height2 / 2.0;
+
+    double centerX1 = x1 + halfWidth1;
+    double centerY1 = y1 + halfHeight1;
+    double centerX2 = x2 + halfWidth2;
+    double centerY2 = y2 + halfHeight2;
+
+    double deltaX = centerX2 - centerX1;
+    double deltaY = centerY2 - centerY1;
+
+    double combinedHalfWidth = halfWidth1 + halfWidth2;
+    double combinedHalfHeight = halfHeight1 + halfHeight2;
+
+    if (fabs(deltaX) < combinedHalfWidth && fabs(deltaY) < combinedHalfHeight)
+    {
+        double overlapX = combinedHalfWidth - fabs(deltaX);
+        double overlapY = combinedHalfHeight - fabs(deltaY);
+
+        if (overlapX < overlapY)
+        {
+            if (deltaX > 0)
+            {
+                lua_pushnumber(L, overlapX);
+                lua_pushnumber(L, 0);
+                lua_pushnumber(L, -overlapX);
+                lua_pushnumber(L, 0);
+            }
+            else
+            {
+                lua_pushnumber(L, -overlapX);
+                lua_pushnumber(L, 0);
+                lua_pushnumber(L, overlapX);
+                lua_pushnumber(L, 0);
+            }
+        }
+        else
+        {
+            if (deltaY > 0)
+            {
+                lua_pushnumber(L, 0);
+                lua_pushnumber(L, overlapY);
+                lua_pushnumber(L, 0);
+                lua_pushnumber(L, -overlapY);
+            }
+            else
+            {
+                lua_pushnumber(L, 0);
+                lua_pushnumber(L, -overlapY);
+                lua_pushnumber(L, 0);
+                lua_pushnumber(L, overlapY);
+            }
+        }
+        return 4;
+    }
+    else
+    {
+        lua_pushnumber(L, 0);
+        lua_pushnumber(L, 0);
+        lua_pushnumber(L, 0);
+        lua_pushnumber(L, 0);
+        return 4;
     }
-    return 0;
 }
 
-int mouse_center(lua_State *L)
+// Scancode for one of namedKeys, SDL_SCANCODE_UNKNOWN if it isn't one
+SDL_Scancode FindNamedKey(const char *name)
 {
-    int windowWidth, windowHeight;
-    SDL_GetWindowSize(window, &windowWidth, &windowHeight);
-    SDL_WarpMouseInWindow(window, windowWidth / 2, windowHeight / 2);
-    return 0;
+    for (size_t i = 0; i < sizeof(namedKeys) / sizeof(namedKeys[0]); i++)
+    {
+        if (strcmp(namedKeys[i].name, name) == 0)
+            return namedKeys[i].scancode;
+    }
+    return SDL_SCANCODE_UNKNOWN;
 }
 
-int mouse_visible(lua_State *L)
+// Scancode of the key that types a character on the current layout, so 'a' is where the a is printed.
+// Letters and digits the layout can't type directly (digits on AZERTY) fall back to the US position
+SDL_Scancode CharacterScancode(int character)
 {
-    bool visible = lua_toboolean(L, 1);
-    SDL_ShowCursor(visible ? SDL_ENABLE : SDL_DISABLE);
-    return 0;
+    character = tolower(character);
+    SDL_Scancode scancode = SDL_GetScancodeFromKey(character);
+    if (scancode != SDL_SCANCODE_UNKNOWN)
+        return scancode;
+    if (character >= 'a' && character <= 'z')
+        return (SDL_Scancode)(SDL_SCANCODE_A + character - 'a');
+    if (character == '0')
+        return SDL_SCANCODE_0;
+    if (character >= '1' && character <= '9')
+        return (SDL_Scancode)(SDL_SCANCODE_1 + character - '1'); // Scancodes run 1 to 9 then 0
+    return SDL_SCANCODE_UNKNOWN;
 }
 
-int window_message(lua_State *L)
+// Set a to z and 0 to 9 in the keys table on top of the stack, again whenever the layout changes
+void FillCharacterKeys(lua_State *L)
 {
-    const char *text = luaL_checkstring(L, 1);
-    const char *title = SDL_GetWindowTitle(window);
+    for (int i = 0; i < 36; i++)
+    {
+        char name[2] = {(char)(i < 26 ? 'a' + i : '0' + i - 26), '\0'};
+        lua_pushinteger(L, CharacterScancode(name[0]));
+        lua_setfield(L, -2, name);
+    }
+}
 
-    SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_INFORMATION, title, text, window);
+// Build keyboard.keys, name to scancode for everything keyboard.down knows by name
+void PushKeyTable(lua_State *L)
+{
+    lua_createtable(L, 0, 64);
+    FillCharacterKeys(L);
+    lua_pushinteger(L, SDL_SCANCODE_SPACE);
+    lua_setfield(L, -2, "space");
+    for (size_t i = 0; i < sizeof(namedKeys) / sizeof(namedKeys[0]); i++)
+    {
+        // The first entry for a name is the one keyboard.down checks
+        lua_getfield(L, -1, namedKeys[i].name);
+        bool taken = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (taken)
+            continue;
+        lua_pushinteger(L, namedKeys[i].scancode);
+        lua_setfield(L, -2, namedKeys[i].name);
+    }
+}
+
+int keyboard_down(lua_State *L)
+{
+    SDL_Scancode scancode;
+
+    if (lua_type(L, 1) == LUA_TNUMBER)
+    {
+        // Codes from keyboard.keys go straight to the state array
+        lua_Integer code = lua_tointeger(L, 1);
+        luaL_argcheck(L, code >= 0 && code < SDL_NUM_SCANCODES, 1, "key code out of range");
+        scancode = (SDL_Scancode)code;
+    }
+    else
+    {
+        size_t length;
+        const char *key = luaL_checklstring(L, 1, &length);
+        if (length == 1)
+        {
+            scancode = CharacterScancode((unsigned char)key[0]);
+        }
+        else
+        {
+            scancode = FindNamedKey(key);
+            if (scancode == SDL_SCANCODE_UNKNOWN)
+                return luaL_error(L, "Unrecognized key: %s", key);
+        }
+    }
+
+    const Uint8 *state = SDL_GetKeyboardState(NULL);
+    lua_pushboolean(L, state[scancode]);
+    return 1;
+}
+
+// Every key and the mouse in one go: keys is a string with a byte per scancode (keys:byte(code + 1) is 1 when held),
+// x and y are the buffer position (nil off the screen), buttons has bit 1, 2 and 4 set for buttons 1, 2 and 3
+int input_snapshot(lua_State *L)
+{
+    int numKeys;
+    const Uint8 *state = SDL_GetKeyboardState(&numKeys);
+    int x, y;
+    Uint32 mouseState = SDL_GetMouseState(&x, &y);
+    int bufferX, bufferY;
+    bool inside = WindowToBuffer(x, y, &bufferX, &bufferY);
+
+    int buttons = 0;
+    if (mouseState & SDL_BUTTON(SDL_BUTTON_LEFT))
+        buttons |= 1;
+    if (mouseState & SDL_BUTTON(SDL_BUTTON_RIGHT))
+        buttons |= 2;
+    if (mouseState & SDL_BUTTON(SDL_BUTTON_MIDDLE))
+        buttons |= 4;
+
+    if (snapshotRef == LUA_NOREF)
+    {
+        lua_createtable(L, 0, 4);
+        snapshotRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotRef);
+
+    lua_pushlstring(L, (const char *)state, numKeys);
+    lua_setfield(L, -2, "keys");
+    if (inside)
+    {
+        lua_pushinteger(L, bufferX);
+        lua_setfield(L, -2, "x");
+        lua_pushinteger(L, bufferY);
+    }
+    else
+    {
+        lua_pushnil(L);
+        lua_setfield(L, -2, "x");
+        lua_pushnil(L);
+    }
+    lua_setfield(L, -2, "y");
+    lua_pushinteger(L, buttons);
+    lua_setfield(L, -2, "buttons");
+    return 1;
+}
+
+// Work out where the buffer sits in the window, called again whenever the window changes size
+void UpdateMouseTransform()
+{
+    int windowWidth = bufferWidth, windowHeight = bufferHeight; // Headless runs map one to one
+    if (window)
+        SDL_GetWindowSize(window, &windowWidth, &windowHeight);
+
+    float bufferAspectRatio = (float)bufferWidth / bufferHeight;
+    float windowAspectRatio = (float)windowWidth / windowHeight;
+
+    int destW, destH, offsetX = 0, offsetY = 0;
+
+    if (windowAspectRatio > bufferAspectRatio)
+    {
+        destH = windowHeight;
+        destW = (int)(windowHeight * bufferAspectRatio);
+        offsetX = (windowWidth - destW) / 2;
+    }
+    else
+    {
+        destW = windowWidth;
+        destH = (int)(windowWidth / bufferAspectRatio);
+        offsetY = (windowHeight - destH) / 2;
+    }
+
+    mouseTransform.offsetX = offsetX;
+    mouseTransform.offsetY = offsetY;
+    mouseTransform.scaleX = (float)bufferWidth / destW;
+    mouseTransform.scaleY = (float)bufferHeight / destH;
+    mouseTransform.valid = true;
+}
+
+// Map a window position onto the buffer, returns false when it lands in the letterboxing
+bool WindowToBuffer(int x, int y, int *bufferX, int *bufferY)
+{
+    if (!mouseTransform.valid)
+        UpdateMouseTransform();
+
+    *bufferX = (int)((x - mouseTransform.offsetX) * mouseTransform.scaleX);
+    *bufferY = (int)((y - mouseTransform.offsetY) * mouseTransform.scaleY);
+
+    return *bufferX >= 0 && *bufferX < bufferWidth && *bufferY >= 0 && *bufferY < bufferHeight;
+}
+
+int mouse_position(lua_State *L)
+{
+    int x, y;
+    SDL_GetMouseState(&x, &y);
+
+    int bufferX, bufferY;
+    if (!WindowToBuffer(x, y, &bufferX, &bufferY))
+    {
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+    else
+    {
+        lua_pushinteger(L, bufferX);
+        lua_pushinteger(L, bufferY);
+    }
+    return 2;
+}
+
+int mouse_down(lua_State *L)
+{
+    int button = luaL_checkinteger(L, 1);
+    Uint32 sdlButton;
+    switch (button)
+    {
+    case 1:
+        sdlButton = SDL_BUTTON_LEFT;
+        break;
+    case 2:
+        sdlButton = SDL_BUTTON_RIGHT;
+        break;
+    case 3:
+        sdlButton = SDL_BUTTON_MIDDLE;
+        break;
+    default:
+        return luaL_error(L, "Invalid button");
+    }
+    Uint32 state = SDL_GetMouseState(NULL, NULL);
+    lua_pushboolean(L, state & SDL_BUTTON(sdlButton));
+    return 1;
+}
+
+int window_title(lua_State *L)
+{
+    const char *title = luaL_checkstring(L, 1);
+    if (!window)
+        return 0;
+    if (pipelined)
+    {
+        char *copy = strdup(title);
+        if (!copy)
+            return luaL_error(L, "Out of memory");
+        SDL_LockMutex(pipeline.lock);
+        free(pipeline.title);
+        pipeline.title = copy;
+        SDL_UnlockMutex(pipeline.lock);
+        WakeMainThread();
+        return 0;
+    }
+    SDL_SetWindowTitle(window, title);
+    return 0;
+}
+
+int window_fullscreen(lua_State *L)
+{
+    bool fullscreen = lua_toboolean(L, 1);
+    if (!window)
+        return 0;
+    if (pipelined)
+    {
+        SDL_LockMutex(pipeline.lock);
+        pipeline.fullscreen = fullscreen;
+        SDL_UnlockMutex(pipeline.lock);
+        WakeMainThread();
+        return 0;
+    }
+    SetFullscreen(fullscreen);
     return 0;
 }
 
-int http_get(lua_State *L)
+// Main thread only, F11 and window.fullscreen
+void SetFullscreen(bool fullscreen)
+{
+    if (fullscreen && (!isFullscreen))
+    {
+        if (SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP) != 0)
+        {
+            LOG("Failed to set fullscreen: %s\n", SDL_GetError());
+        }
+        else
+        {
+            isFullscreen = true;
+        }
+    }
+    else if ((!fullscreen) && isFullscreen)
+    {
+        if (SDL_SetWindowFullscreen(window, 0) != 0)
+        {
+            LOG("Failed to exit fullscreen: %s\n", SDL_GetError());
+        }
+        else
+        {
+            isFullscreen = false;
+        }
+    }
+}
+
+int window_close(lua_State *L)
 {
-    // Implement a cross-platform HTTP GET request if necessary
-    lua_pushnil(L);
-    lua_pushinteger(L, 501); // Not Implemented
-    return 2;
+    running = false;
+    return 0;
 }
 
-int util_distance(lua_State *L)
+// Read the script and ROM paths and the flags, which can go anywhere:
+// --headless, --frames N, --seconds S, --output NAME, --dump N (more than once for more frames) and --trace PATH
+bool ParseArguments(int argc, char *argv[], LaunchOptions *options)
 {
-    double x1 = luaL_checknumber(L, 1);
-    double y1 = luaL_checknumber(L, 2);
-    double x2 = luaL_checknumber(L, 3);
-    double y2 = luaL_checknumber(L, 4);
+    LaunchOptions defaults = {"main.lua", "rom.rom", false, 0, 0.0, "frame", {0}, 0, NULL};
+    *options = defaults;
 
-    double dx = x2 - x1;
-    double dy = y2 - y1;
-    double distance = sqrt(dx * dx + dy * dy);
+    int positional = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
 
-    lua_pushnumber(L, distance);
-    return 1;
+        if (strcmp(arg, "--headless") == 0)
+        {
+            options->headless = true;
+        }
+        else if (strcmp(arg, "--frames") == 0 && hasValue)
+        {
+            options->frames = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "--seconds") == 0 && hasValue)
+        {
+            options->seconds = atof(argv[++i]);
+        }
+        else if (strcmp(arg, "--output") == 0 && hasValue)
+        {
+            options->output = argv[++i];
+        }
+        else if (strcmp(arg, "--dump") == 0 && hasValue)
+        {
+            if (options->dumpCount == MAX_DUMP_FRAMES)
+            {
+                LOG("Too many --dump frames, at most %d\n", MAX_DUMP_FRAMES);
+                return false;
+            }
+            options->dumpFrames[options->dumpCount++] = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "--trace") == 0 && hasValue)
+        {
+            options->tracePath = argv[++i];
+        }
+        else if (strncmp(arg, "--", 2) == 0)
+        {
+            LOG("Unknown or incomplete option: %s\n", arg);
+            return false;
+        }
+        else if (positional == 0)
+        {
+            options->scriptPath = arg;
+            positional++;
+        }
+        else if (positional == 1)
+        {
+            options->romPath = arg;
+            positional++;
+        }
+    }
+    return true;
 }
 
-int util_random(lua_State *L)
+// Create the window sized to the buffer and its renderer
+bool OpenWindow(const char *title)
 {
-    int argc = lua_gettop(L);
-    if (argc == 0)
+    // Calculate buffer aspect ratio
+    float bufferAspect = (float)bufferWidth / (float)bufferHeight;
+
+    // Get the current display index (assuming display 0)
+    int displayIndex = 0;
+
+    // Get the current display mode
+    SDL_DisplayMode displayMode;
+    if (SDL_GetCurrentDisplayMode(displayIndex, &displayMode) != 0)
     {
-        lua_pushnumber(L, (double)rand() / RAND_MAX);
+        printf("SDL_GetCurrentDisplayMode Error: %s\n", SDL_GetError());
+        return false;
     }
-    else if (argc == 2)
+
+    int screenWidth = displayMode.w;
+    int screenHeight = displayMode.h;
+
+    // Determine the minimum screen dimension
+    int minScreenDim = (screenWidth < screenHeight) ? screenWidth : screenHeight;
+
+    // Calculate maximum window size (half of the minimum screen dimension)
+    int maxWindowSize = minScreenDim / 2;
+
+    // Calculate window size while maintaining aspect ratio
+    int windowWidth = maxWindowSize;
+    int windowHeight = (int)(maxWindowSize / bufferAspect);
+
+    // If height exceeds maxWindowSize, adjust width instead
+    if (windowHeight > maxWindowSize)
     {
-        double min = luaL_checknumber(L, 1);
-        double max = luaL_checknumber(L, 2);
-        double random = min + ((double)rand() / RAND_MAX) * (max - min);
-        lua_pushnumber(L, random);
+        windowHeight = maxWindowSize;
+        windowWidth = (int)(maxWindowSize * bufferAspect);
     }
-    else
+
+    // Create SDL_Window and SDL_Renderer with the actual buffer size
+    window = SDL_CreateWindow(title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, windowWidth, windowHeight, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+    if (!window)
     {
-        return luaL_error(L, "Invalid arguments to util.random");
+        LOG("SDL_CreateWindow Error: %s\n", SDL_GetError());
+        return false;
     }
-    return 1;
+
+    // Create renderer, vsync caps the framerate unless fps pacing is asked for since the two fight each other.
+    // Setting the vsync global picks either way
+    lua_getglobal(L, "vsync");
+    bool vsync = lua_isnil(L, -1) ? TargetFramePeriod() == 0.0 : lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    Uint32 rendererFlags = SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+    renderer = SDL_CreateRenderer(window, -1, rendererFlags);
+    if (!renderer)
+    {
+        LOG("SDL_CreateRenderer Error: %s\n", SDL_GetError());
+        SDL_DestroyWindow(window);
+        window = NULL;
+        return false;
+    }
+    return true;
 }
 
-int util_clamp(lua_State *L)
+// Seconds per frame from the fps global, 0 when it isn't set
+double TargetFramePeriod()
 {
-    double value = luaL_checknumber(L, 1);
-    double minVal = luaL_checknumber(L, 2);
-    double maxVal = luaL_checknumber(L, 3);
-
-    if (value < minVal)
-        value = minVal;
-    else if (value > maxVal)
-        value = maxVal;
-
-    lua_pushnumber(L, value);
-    return 1;
+    lua_getglobal(L, "fps");
+    double fps = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return fps > 0.0 ? 1.0 / fps : 0.0;
 }
 
-int util_lerp(lua_State *L)
+// Write the last finished frame out as a 24 bit BMP
+bool SaveFrame(const char *path)
 {
-    double start = luaL_checknumber(L, 1);
-    double end = luaL_checknumber(L, 2);
-    double t = luaL_checknumber(L, 3);
-
-    double result = start + t * (end - start);
-    lua_pushnumber(L, result);
-    return 1;
+    Uint32 *pixels = persistentCanvas ? pixelsBack : pixelsFront;
+    SDL_Surface *frame = SDL_CreateRGBSurfaceWithFormatFrom(pixels, bufferWidth, bufferHeight, 32, bufferStride * sizeof(Uint32), SDL_PIXELFORMAT_RGBA8888);
+    SDL_Surface *rgb = frame ? SDL_ConvertSurfaceFormat(frame, SDL_PIXELFORMAT_RGB24, 0) : NULL;
+    bool saved = rgb && SDL_SaveBMP(rgb, path) == 0;
+    if (!saved)
+        LOG("Failed to save %s: %s\n", path, SDL_GetError());
+    SDL_FreeSurface(rgb);
+    SDL_FreeSurface(frame);
+    return saved;
 }
 
-int util_intersect(lua_State *L)
+// Everything the frame loop does with an SDL event, on the thread running Lua
+void HandleEvent(const SDL_Event *e)
 {
-    double x1 = luaL_checknumber(L, 1);
-    double y1 = luaL_checknumber(L, 2);
-    double width1 = luaL_checknumber(L, 3);
-    double height1 = luaL_checknumber(L, 4);
-
-    double x2 = luaL_checknumber(L, 5);
-    double y2 = luaL_checknumber(L, 6);
-    double width2 = luaL_checknumber(L, 7);
-    double height2 = luaL_checknumber(L, 8);
+    if (e->type == SDL_QUIT)
+    {
+        running = false;
+    }
+    else if (e->type == SDL_WINDOWEVENT && e->window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+    {
+        mouseTransform.valid = false;
+    }
+    else if (e->type == SDL_KEYMAPCHANGED)
+    {
+        // keyboard.keys follows the layout like the one letter names do
+        lua_getglobal(L, "keyboard");
+        if (lua_istable(L, -1))
+        {
+            lua_getfield(L, -1, "keys");
+            if (lua_istable(L, -1))
+                FillCharacterKeys(L);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    else if (e->type == SDL_RENDER_TARGETS_RESET || e->type == SDL_RENDER_DEVICE_RESET)
+    {
+        // The texture may have lost its contents, upload all of it next time
+        DirtyRect all = {0, 0, bufferWidth - 1, bufferHeight - 1};
+        dirtyUploaded = all;
+    }
+    else if (e->type == SDL_KEYDOWN)
+    {
+        QueueEvent(e);
+        if (e->key.keysym.sym == SDLK_F9)
+        {
+            ToggleProfiler();
+        }
+        else if (e->key.keysym.sym == SDLK_F10)
+        {
+            ToggleTrace();
+        }
+        else if (e->key.keysym.sym == SDLK_F11 && !pipelined)
+        {
+            // When pipelined the main thread has done it already
+            SetFullscreen(!isFullscreen);
+        }
+    }
+    else if (e->type == SDL_MOUSEBUTTONDOWN || e->type == SDL_MOUSEBUTTONUP || e->type == SDL_MOUSEMOTION ||
+             e->type == SDL_KEYUP || e->type == SDL_TEXTINPUT)
+    {
+        QueueEvent(e);
+    }
+}
 
-    double halfWidth1 = width1 / 2.0;
-    double halfHeight1 = height1 / 2.0;
-    double halfWidth2 = width2 / 2.0;
-    double halfHeight2 = height2 / 2.0;
+// The frame loop: events, update, swap, then pacing and presenting. Runs on the main thread, or on the update thread
+// when pipelined. Returns how many frames it ran
+int RunFrames(void *data)
+{
+    LaunchOptions *options = (LaunchOptions *)data;
 
-    double centerX1 = x1 + halfWidth1;
-    double centerY1 = y1 + halfHeight1;
-    double centerX2 = x2 + halfWidth2;
-    double centerY2 = y2 + halfHeight2;
+    // Initialize timing for deltaTime
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint64 lastTime = 0;
+    double deltaTime = 0.0;
+    Uint64 runStart = now;
+    int frameCount = 0;
 
-    double deltaX = centerX2 - centerX1;
-    double deltaY = centerY2 - centerY1;
+    while (running)
+    {
+        // Event handlers draw too, so the frame's buffer has to be ready before them
+        Uint64 phaseMark = SDL_GetPerformanceCounter();
+        LockBackBuffer();
+        EndPhase(PHASE_SWAP, &phaseMark);
 
-    double combinedHalfWidth = halfWidth1 + halfWidth2;
-    double combinedHalfHeight = halfHeight1 + halfHeight2;
+        // Calculate deltaTime
+        lastTime = now;
+        now = SDL_GetPerformanceCounter();
+        deltaTime = (double)(now - lastTime) / (double)SDL_GetPerformanceFrequency();
+        if (headless)
+        {
+            // Frames go as fast as they can, so step time by the fps the script asked for to keep runs repeatable
+            double period = TargetFramePeriod();
+            deltaTime = period > 0.0 ? period : 1.0 / 60.0;
+        }
 
-    if (fabs(deltaX) < combinedHalfWidth && fabs(deltaY) < combinedHalfHeight)
-    {
-        double overlapX = combinedHalfWidth - fabs(deltaX);
-        double overlapY = combinedHalfHeight - fabs(deltaY);
+        // Handle events
+        if (pipelined)
+        {
+            HandleForwardedEvents();
+        }
+        else
+        {
+            SDL_Event e;
+            while (SDL_PollEvent(&e))
+                HandleEvent(&e);
+        }
+        SetProfilerInsideLua(true);
+        DispatchEvents();
+        EndPhase(PHASE_EVENTS, &phaseMark);
 
-        if (overlapX < overlapY)
+        // Update pixels by calling Lua's update function with deltaTime
+        double alpha = RunFixedUpdates(deltaTime);
+        UpdatePixelsFromLua(deltaTime, alpha);
+        SetProfilerInsideLua(false);
+        EndPhase(PHASE_UPDATE, &phaseMark);
+        tracer.depth = 0; // Zones don't outlive the frame, an error in update can leave some open
+        FinishFrame();
+        EndPhase(PHASE_SWAP, &phaseMark);
+        Uint64 frameReady = phaseMark;
+
+        frameCount++;
+        if (headless)
         {
-            if (deltaX > 0)
-            {
-                lua_pushnumber(L, overlapX);
-                lua_pushnumber(L, 0);
-                lua_pushnumber(L, -overlapX);
-                lua_pushnumber(L, 0);
-            }
-            else
+            // No pacing or presenting, just save the frames asked for and stop when the run is over
+            for (int i = 0; i < options->dumpCount; i++)
             {
-                lua_pushnumber(L, -overlapX);
-                lua_pushnumber(L, 0);
-                lua_pushnumber(L, overlapX);
-                lua_pushnumber(L, 0);
+                if (options->dumpFrames[i] == frameCount)
+                {
+                    char path[1024];
+                    snprintf(path, sizeof(path), "%s_%d.bmp", options->output, frameCount);
+                    SaveFrame(path);
+                }
             }
+            RecordFrameTime();
+            RecordFrameStats();
+
+            double elapsed = (double)(SDL_GetPerformanceCounter() - runStart) / (double)SDL_GetPerformanceFrequency();
+            if ((options->frames > 0 && frameCount >= options->frames) || (options->seconds > 0.0 && elapsed >= options->seconds))
+                running = false;
+            continue;
+        }
+
+        // Hold the frame until its slot (fps zero or not set runs as fast as possible), then render the front buffer
+        PaceFrame(TargetFramePeriod());
+        EndPhase(PHASE_PACE, &phaseMark);
+        if (pipelined)
+        {
+            // The main thread has this frame, pick up the numbers for the ones it has shown
+            CollectPresentedFrames();
         }
         else
         {
-            if (deltaY > 0)
-            {
-                lua_pushnumber(L, 0);
-                lua_pushnumber(L, overlapY);
-                lua_pushnumber(L, 0);
-                lua_pushnumber(L, -overlapY);
-            }
-            else
-            {
-                lua_pushnumber(L, 0);
-                lua_pushnumber(L, -overlapY);
-                lua_pushnumber(L, 0);
-                lua_pushnumber(L, overlapY);
-            }
+            DrawBuffer();
+            RecordLatency((double)(SDL_GetPerformanceCounter() - frameReady) / (double)SDL_GetPerformanceFrequency());
         }
-        return 4;
-    }
-    else
-    {
-        lua_pushnumber(L, 0);
-        lua_pushnumber(L, 0);
-        lua_pushnumber(L, 0);
-        lua_pushnumber(L, 0);
-        return 4;
+        RecordFrameTime();
+        RecordFrameStats();
     }
+    return frameCount;
 }
 
-int keyboard_down(lua_State *L)
-{
-    const char *key = luaL_checkstring(L, 1);
-    SDL_Scancode scancode;
+#ifdef PLF_BENCH
+// Benchmark runner built as plf_bench, each scene runs headless and the results are written as JSON:
+// plf_bench [scene.lua ...] [--scenes DIR] [--frames N] [--warmup N] [--rom PATH] [--output PATH] [--label TEXT]
+#define BENCH_ROM_IMAGES 16
+#define BENCH_ROM_SIZE 64
 
-    if (strlen(key) == 1)
-    {
-        int keycode = tolower(key[0]);
-        scancode = SDL_GetScancodeFromKey(keycode);
-    }
-    else
-    {
-        if (strcmp(key, "enter") == 0)
-            scancode = SDL_SCANCODE_RETURN;
-        else if (strcmp(key, "shift") == 0)
-            scancode = SDL_SCANCODE_LSHIFT; // or SDL_SCANCODE_RSHIFT
-        else if (strcmp(key, "control") == 0)
-            scancode = SDL_SCANCODE_LCTRL; // or SDL_SCANCODE_RCTRL
-        else if (strcmp(key, "alt") == 0)
-            scancode = SDL_SCANCODE_LALT; // or SDL_SCANCODE_RALT
-        else if (strcmp(key, "escape") == 0)
-            scancode = SDL_SCANCODE_ESCAPE;
-        else if (strcmp(key, "back") == 0)
-            scancode = SDL_SCANCODE_BACKSPACE;
-        else if (strcmp(key, "tab") == 0)
-            scancode = SDL_SCANCODE_TAB;
-        else if (strcmp(key, "left") == 0)
-            scancode = SDL_SCANCODE_LEFT;
-        else if (strcmp(key, "right") == 0)
-            scancode = SDL_SCANCODE_RIGHT;
-        else if (strcmp(key, "up") == 0)
-            scancode = SDL_SCANCODE_UP;
-        else if (strcmp(key, "down") == 0)
-            scancode = SDL_SCANCODE_DOWN;
-        else
-            return luaL_error(L, "Unrecognized key: %s", key);
-    }
+// Run when no scenes are named, each is DIR/name.lua
+static const char *benchScenes[] = {"shader", "pixels", "circles", "sprites", "romLoads"};
 
-    const Uint8 *state = SDL_GetKeyboardState(NULL);
-    lua_pushboolean(L, state[scancode]);
-    return 1;
+typedef struct BenchResult
+{
+    char name[64];
+    int frames;
+    double seconds;
+    double calls;  // Drawing calls per frame, the scene's benchCalls
+    double pixels; // Pixels written per frame, the scene's benchPixels
+} BenchResult;
+
+static void WriteUint32(Uint8 *p, Uint32 value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
 }
 
-int mouse_position(lua_State *L)
+// Make a ROM with images b000 to b015 so the scenes don't depend on anyone's real one
+static bool WriteBenchRom(const char *path)
 {
-    int x, y;
-    SDL_GetMouseState(&x, &y);
-
-    int windowWidth, windowHeight;
-    SDL_GetWindowSize(window, &windowWidth, &windowHeight);
-
-    float bufferAspectRatio = (float)bufferWidth / bufferHeight;
-    float windowAspectRatio = (float)windowWidth / windowHeight;
-
-    int destW, destH, offsetX = 0, offsetY = 0;
-
-    if (windowAspectRatio > bufferAspectRatio)
+    FILE *file = fopen(path, "wb");
+    if (!file)
     {
-        destH = windowHeight;
-        destW = (int)(windowHeight * bufferAspectRatio);
-        offsetX = (windowWidth - destW) / 2;
+        LOG("Failed to write %s\n", path);
+        return false;
     }
-    else
+
+    Uint8 header[5] = {'i', 'm', 'a', 'g', BENCH_ROM_IMAGES};
+    fwrite(header, 1, sizeof(header), file);
+    for (int i = 0; i < BENCH_ROM_IMAGES; i++)
     {
-        destW = windowWidth;
-        destH = (int)(windowWidth / bufferAspectRatio);
-        offsetY = (windowHeight - destH) / 2;
+        Uint8 entry[16];
+        char name[8];
+        snprintf(name, sizeof(name), "b%03d", i);
+        WriteUint32(entry, BENCH_ROM_SIZE * BENCH_ROM_SIZE);
+        memcpy(entry + 4, name, 4);
+        WriteUint32(entry + 8, BENCH_ROM_SIZE);
+        WriteUint32(entry + 12, BENCH_ROM_SIZE);
+        fwrite(entry, 1, sizeof(entry), file);
+
+        // A transparent border with a pattern inside, like a sprite
+        for (int y = 0; y < BENCH_ROM_SIZE; y++)
+        {
+            for (int x = 0; x < BENCH_ROM_SIZE; x++)
+            {
+                bool border = x < 4 || y < 4 || x >= BENCH_ROM_SIZE - 4 || y >= BENCH_ROM_SIZE - 4;
+                int value = border ? 0 : (x * 7 + y * 3 + i * 31) % 512 + 1;
+                Uint8 pixel[2] = {value & 0xFF, (value >> 8) & 0xFF};
+                fwrite(pixel, 1, sizeof(pixel), file);
+            }
+        }
     }
+    return fclose(file) == 0;
+}
+
+// Put everything a scene can change back the way a fresh start has it
+static void CloseBenchScene()
+{
+    FreeDeferred();
+    CloseParallelShader();
+    StopWorkerPool();
+    StopAssetLoader();
+    FreeEvents();
+    StopProfiler();
+    ClearProfile();
+    tracer.depth = 0;
+    lua_close(L);
+    L = NULL;
+    eventQueue.callbackRef = eventQueue.listRef = eventQueue.poolRef = LUA_NOREF;
+    eventQueue.poolSize = eventQueue.listLength = 0;
+    snapshotRef = LUA_NOREF;
 
-    float scaleX = (float)bufferWidth / destW;
-    float scaleY = (float)bufferHeight / destH;
+    free(pixelsFront);
+    free(pixelsBack);
+    pixelsFront = pixelsBack = NULL;
+    persistentCanvas = false;
+    backBufferPinned = false;
+    DirtyRect empty = {0, 0, -1, -1};
+    dirtyFront = dirtyBack = dirtyUploaded = empty;
+    memset(&pacer, 0, sizeof(pacer));
+    EvictTextures(0);
+    textureCache.budget = DEFAULT_TEXTURE_BUDGET;
+    SelectSimd(NULL);
+    running = true;
+}
 
-    int bufferX = (int)((x - offsetX) * scaleX);
-    int bufferY = (int)((y - offsetY) * scaleY);
+// Run warmup frames then time frames more, returns false if the scene couldn't be loaded
+static bool RunBenchScene(const char *path, int frames, int warmup, BenchResult *result)
+{
+    InitializeLua(path);
+    if (!L)
+        return false;
 
-    if (bufferX < 0 || bufferX >= bufferWidth || bufferY < 0 || bufferY >= bufferHeight)
+    lua_getglobal(L, "width");
+    lua_getglobal(L, "height");
+    if (!lua_isinteger_custom(L, -2) || !lua_isinteger_custom(L, -1))
     {
-        lua_pushnil(L);
-        lua_pushnil(L);
+        LOG("%s: expected integers for 'width' and 'height'\n", path);
+        lua_pop(L, 2);
+        CloseBenchScene();
+        return false;
     }
-    else
+    SetupBuffers((int)lua_tointeger(L, -2), (int)lua_tointeger(L, -1));
+    lua_pop(L, 2);
+
+    // Work done per frame, as the scene reports it
+    lua_getglobal(L, "benchCalls");
+    result->calls = lua_tonumber(L, -1);
+    lua_getglobal(L, "benchPixels");
+    result->pixels = lua_tonumber(L, -1);
+    lua_getglobal(L, "benchName");
+    const char *name = lua_isstring(L, -1) ? lua_tostring(L, -1) : path;
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    lua_pop(L, 3);
+
+    // Same dt every frame so scenes do the same work every run
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < warmup + frames && running; i++)
     {
-        lua_pushinteger(L, bufferX);
-        lua_pushinteger(L, bufferY);
+        if (i == warmup)
+            start = SDL_GetPerformanceCounter();
+        UpdatePixelsFromLua(1.0 / 60.0, 0.0);
+        FinishFrame();
     }
-    return 2;
+    result->frames = frames;
+    result->seconds = (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+
+    CloseBenchScene();
+    return true;
 }
 
-int mouse_down(lua_State *L)
+static void WriteJsonString(FILE *file, const char *text)
 {
-    int button = luaL_checkinteger(L, 1);
-    Uint32 sdlButton;
-    switch (button)
+    fputc('"', file);
+    for (const char *c = text; *c; c++)
     {
-    case 1:
-        sdlButton = SDL_BUTTON_LEFT;
-        break;
-    case 2:
-        sdlButton = SDL_BUTTON_RIGHT;
-        break;
-    case 3:
-        sdlButton = SDL_BUTTON_MIDDLE;
-        break;
-    default:
-        return luaL_error(L, "Invalid button");
+        if (*c == '"' || *c == '\\')
+            fputc('\\', file);
+        if ((unsigned char)*c >= 0x20)
+            fputc(*c, file);
     }
-    Uint32 state = SDL_GetMouseState(NULL, NULL);
-    lua_pushboolean(L, state & SDL_BUTTON(sdlButton));
-    return 1;
+    fputc('"', file);
 }
 
-int window_title(lua_State *L)
+static bool WriteBenchJson(const char *path, const char *label, const char *kernels, const BenchResult *results, int count)
 {
-    const char *title = luaL_checkstring(L, 1);
-    SDL_SetWindowTitle(window, title);
-    return 0;
-}
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        LOG("Failed to write %s\n", path);
+        return false;
+    }
 
-int window_fullscreen(lua_State *L)
-{
-    bool fullscreen = lua_toboolean(L, 1);
-    if (fullscreen && (!isFullscreen))
+    fprintf(file, "{\n  \"label\": ");
+    WriteJsonString(file, label);
+    fprintf(file, ",\n  \"simd\": ");
+    WriteJsonString(file, kernels);
+    fprintf(file, ",\n  \"cpus\": %d,\n  \"scenes\": [\n", SDL_GetCPUCount());
+    for (int i = 0; i < count; i++)
     {
-        if (SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP) != 0)
-        {
-            LOG("Failed to set fullscreen: %s\n", SDL_GetError());
-        }
-        else
-        {
-            isFullscreen = true;
-        }
+        const BenchResult *r = &results[i];
+        double seconds = r->seconds > 0.0 ? r->seconds : 1e-9;
+        fprintf(file, "    {\"name\": ");
+        WriteJsonString(file, r->name);
+        fprintf(file, ", \"frames\": %d, \"seconds\": %.6f, \"framesPerSecond\": %.3f, \"callsPerSecond\": %.1f, \"nsPerPixel\": %.4f}%s\n",
+                r->frames, r->seconds, r->frames / seconds, r->calls * r->frames / seconds,
+                r->pixels > 0.0 ? r->seconds * 1e9 / (r->pixels * r->frames) : 0.0, i + 1 < count ? "," : "");
     }
-    else if ((!fullscreen) && isFullscreen)
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *scenesDir = "bench/scenes";
+    const char *romPath = "plf_bench.rom";
+    const char *outputPath = "bench_results.json";
+    const char *label = "";
+    int frames = 120;
+    int warmup = 10;
+    const char *paths[64];
+    int pathCount = 0;
+
+    for (int i = 1; i < argc; i++)
     {
-        if (SDL_SetWindowFullscreen(window, 0) != 0)
-        {
-            LOG("Failed to exit fullscreen: %s\n", SDL_GetError());
-        }
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--scenes") == 0 && hasValue)
+            scenesDir = argv[++i];
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue)
+            frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--warmup") == 0 && hasValue)
+            warmup = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rom") == 0 && hasValue)
+            romPath = argv[++i];
+        else if (strcmp(argv[i], "--output") == 0 && hasValue)
+            outputPath = argv[++i];
+        else if (strcmp(argv[i], "--label") == 0 && hasValue)
+            label = argv[++i];
+        else if (strncmp(argv[i], "--", 2) != 0 && pathCount < 64)
+            paths[pathCount++] = argv[i];
         else
         {
-            isFullscreen = false;
+            LOG("Unknown or incomplete option: %s\n", argv[i]);
+            return 1;
         }
     }
-    return 0;
-}
-
-int window_close(lua_State *L)
-{
-    running = false;
-    return 0;
-}
+    if (frames < 1)
+        frames = 1;
 
-int main(int argc, char *argv[])
-{
-    // Initialize SDL
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS) != 0)
+    headless = true;
+    if (SDL_Init(SDL_INIT_TIMER | SDL_INIT_EVENTS) != 0)
     {
         LOG("SDL_Init Error: %s\n", SDL_GetError());
         return 1;
     }
-
-    const char *scriptPath;
-    const char *romPath;
-
-    if (argc < 2)
+    globalFormat = SDL_AllocFormat(SDL_PIXELFORMAT_RGBA8888);
+    if (!globalFormat || !WriteBenchRom(romPath))
     {
-        // No arguments provided; use default paths
-        scriptPath = "main.lua";
-        romPath = "rom.rom";
+        SDL_Quit();
+        return 1;
     }
-    else
+    BuildPalette();
+    SelectSimd(NULL);
+    romPathGlobal = romPath;
+    OpenRom(romPath);
+
+    char scenePaths[sizeof(benchScenes) / sizeof(benchScenes[0])][1024];
+    if (pathCount == 0)
     {
-        // Use provided script path
-        scriptPath = argv[1];
-        // Use provided ROM path if available; otherwise, default to "rom.rom"
-        romPath = (argc >= 3) ? argv[2] : "rom.rom";
+        for (size_t i = 0; i < sizeof(benchScenes) / sizeof(benchScenes[0]); i++)
+        {
+            snprintf(scenePaths[i], sizeof(scenePaths[i]), "%s/%s.lua", scenesDir, benchScenes[i]);
+            paths[pathCount++] = scenePaths[i];
+        }
     }
 
-    romPathGlobal = romPath;
-    // Create a temporary window and renderer to initialize the globalFormat
-    // This is necessary because SDL needs a renderer to get a pixel format
-    window = SDL_CreateWindow("Temp", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1, 1, SDL_WINDOW_HIDDEN);
-    if (!window)
+    BenchResult results[64];
+    int resultCount = 0;
+    printf("%-12s %10s %14s %12s\n", "scene", "frames/s", "calls/s", "ns/pixel");
+    for (int i = 0; i < pathCount; i++)
     {
-        LOG("SDL_CreateWindow Error: %s\n", SDL_GetError());
-        SDL_Quit();
-        return 1;
+        BenchResult *r = &results[resultCount];
+        if (!RunBenchScene(paths[i], frames, warmup, r))
+            continue;
+        resultCount++;
+        double seconds = r->seconds > 0.0 ? r->seconds : 1e-9;
+        printf("%-12s %10.1f %14.0f %12.3f\n", r->name, r->frames / seconds, r->calls * r->frames / seconds,
+               r->pixels > 0.0 ? r->seconds * 1e9 / (r->pixels * r->frames) : 0.0);
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-    if (!renderer)
+    bool written = WriteBenchJson(outputPath, label, simd.name, results, resultCount);
+    CloseRom();
+    SDL_FreeFormat(globalFormat);
+    SDL_Quit();
+    return written && resultCount == pathCount ? 0 : 1;
+}
+#else
+int main(int argc, char *argv[])
+{
+    LaunchOptions options;
+    if (!ParseArguments(argc, argv, &options))
+        return 1;
+    headless = options.headless;
+
+    // Initialize SDL, headless runs leave video out so they work without a display
+    Uint32 subsystems = SDL_INIT_TIMER | SDL_INIT_EVENTS | (headless ? 0 : SDL_INIT_VIDEO);
+    if (SDL_Init(subsystems) != 0)
     {
-        LOG("SDL_CreateRenderer Error: %s\n", SDL_GetError());
-        SDL_DestroyWindow(window);
-        SDL_Quit();
+        LOG("SDL_Init Error: %s\n", SDL_GetError());
         return 1;
     }
 
+    const char *scriptPath = options.scriptPath;
+    romPathGlobal = options.romPath;
+    OpenRom(romPathGlobal);
+
+    // The pixel format doesn't need a renderer, so there's no window until the script is loaded
     globalFormat = SDL_AllocFormat(SDL_PIXELFORMAT_RGBA8888);
     if (!globalFormat)
     {
         LOG("SDL_AllocFormat Error: %s\n", SDL_GetError());
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
         SDL_Quit();
         return 1;
     }
-
-    // Destroy the temporary window and renderer
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
-    window = NULL;
-    renderer = NULL;
+    BuildPalette();
+    SelectSimd(NULL);
 
     // Initialize Lua
     InitializeLua(scriptPath);
@@ -1165,57 +6622,33 @@ int main(int argc, char *argv[])
     }
     lua_pop(L, 1);
 
-    // Calculate buffer aspect ratio
-    float bufferAspect = (float)bufferWidth / (float)bufferHeight;
-
-    // Get the current display index (assuming display 0)
-    int displayIndex = 0;
-
-    // Get the current display mode
-    SDL_DisplayMode displayMode;
-    if (SDL_GetCurrentDisplayMode(displayIndex, &displayMode) != 0)
-    {
-        printf("SDL_GetCurrentDisplayMode Error: %s\n", SDL_GetError());
-        SDL_Quit();
-        return 1;
-    }
-
-    int screenWidth = displayMode.w;
-    int screenHeight = displayMode.h;
-
-    // Determine the minimum screen dimension
-    int minScreenDim = (screenWidth < screenHeight) ? screenWidth : screenHeight;
-
-    // Calculate maximum window size (half of the minimum screen dimension)
-    int maxWindowSize = minScreenDim / 2;
-
-    // Calculate window size while maintaining aspect ratio
-    int windowWidth = maxWindowSize;
-    int windowHeight = (int)(maxWindowSize / bufferAspect);
-
-    // If height exceeds maxWindowSize, adjust width instead
-    if (windowHeight > maxWindowSize)
-    {
-        windowHeight = maxWindowSize;
-        windowWidth = (int)(maxWindowSize * bufferAspect);
-    }
+    // Run Lua on an update thread while the main thread presents, if the script asks for it
+    lua_getglobal(L, "pipelined");
+    pipelined = !headless && lua_toboolean(L, -1);
+    lua_pop(L, 1);
 
-    // Create SDL_Window and SDL_Renderer with the actual buffer size
-    window = SDL_CreateWindow(windowTitle, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, windowWidth, windowHeight, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
-    if (!window)
+    if (!headless && !OpenWindow(windowTitle))
     {
-        LOG("SDL_CreateWindow Error: %s\n", SDL_GetError());
         lua_close(L);
         SDL_FreeFormat(globalFormat);
         SDL_Quit();
         return 1;
     }
 
-    // Create renderer
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-    if (!renderer)
+    // Render straight into the texture if the script asks for it
+    lua_getglobal(L, "zeroCopy");
+    lockedRendering = !headless && !pipelined && lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    // Setup double buffers
+    SetupBuffers(bufferWidth, bufferHeight);
+    if (pipelined && !StartPipeline())
     {
-        LOG("SDL_CreateRenderer Error: %s\n", SDL_GetError());
+        StopPipeline();
+        free(pixelsFront);
+        free(pixelsBack);
+        SDL_DestroyTexture(texture);
+        SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
         lua_close(L);
         SDL_FreeFormat(globalFormat);
@@ -1223,217 +6656,62 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    // Setup double buffers
-    SetupBuffers(bufferWidth, bufferHeight);
-
     // Seed random number generator
     srand((unsigned int)time(NULL));
 
-    // Initialize timing for deltaTime
-    Uint64 now = SDL_GetPerformanceCounter();
-    Uint64 lastTime = 0;
-    double deltaTime = 0.0;
-
-    // Desired frame time in seconds (1.0 / fps)
-    double desiredFrameTime = 0.0;
+    Uint64 runStart = SDL_GetPerformanceCounter();
+    if (options.tracePath)
+        StartTrace();
 
     // Main loop
-    SDL_Event e;
+    int frameCount = pipelined ? RunPipelined(&options) : RunFrames(&options);
 
-    while (running)
+    if (headless)
     {
-        // Frame start time
-        Uint64 frameStart = SDL_GetPerformanceCounter();
-
-        // Calculate deltaTime
-        lastTime = now;
-        now = SDL_GetPerformanceCounter();
-        deltaTime = (double)(now - lastTime) / (double)SDL_GetPerformanceFrequency();
-
-        // Handle events
-        while (SDL_PollEvent(&e))
+        double elapsed = (double)(SDL_GetPerformanceCounter() - runStart) / (double)SDL_GetPerformanceFrequency();
+        printf("Headless: %d frames in %.3f s (%.1f fps)\n", frameCount, elapsed, elapsed > 0.0 ? frameCount / elapsed : 0.0);
+        if (options.dumpCount == 0 && frameCount > 0)
         {
-            // Handle events
-            if (e.type == SDL_QUIT)
-            {
-                running = false;
-            }
-            else if (e.type == SDL_KEYDOWN)
-            {
-                if (e.key.keysym.sym == SDLK_F11)
-                {
-                    if (!isFullscreen)
-                    {
-                        if (SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP) != 0)
-                        {
-                            LOG("Failed to set fullscreen: %s\n", SDL_GetError());
-                        }
-                        else
-                        {
-                            isFullscreen = true;
-                        }
-                    }
-                    else
-                    {
-                        if (SDL_SetWindowFullscreen(window, 0) != 0)
-                        {
-                            LOG("Failed to exit fullscreen: %s\n", SDL_GetError());
-                        }
-                        else
-                        {
-                            isFullscreen = false;
-                        }
-                    }
-                }
-            }
-            else if (e.type == SDL_MOUSEBUTTONDOWN)
-            {
-                int luaButton = 0; // Initialize luaButton to 0 (invalid)
-
-                // Map SDL button codes to desired Lua button numbers
-                switch (e.button.button)
-                {
-                case SDL_BUTTON_LEFT:
-                    luaButton = 1; // Left button
-                    break;
-                case SDL_BUTTON_RIGHT:
-                    luaButton = 2; // Right button
-                    break;
-                case SDL_BUTTON_MIDDLE:
-                    luaButton = 3; // Middle button
-                    break;
-                default:
-                    // If it's not left, right, or middle button, do nothing
-                    break;
-                }
-
-                // Proceed only if luaButton is valid (1, 2, or 3)
-                if (luaButton != 0)
-                {
-                    lua_getglobal(L, "mouseDown"); // Get the 'mouseDown' function from Lua
-
-                    if (lua_isfunction(L, -1))
-                    {
-                        lua_pushinteger(L, luaButton); // Push the mapped button number to Lua
-
-                        // Call the Lua function with 1 argument and 0 return values
-                        if (lua_pcall(L, 1, 0, 0) != LUA_OK)
-                        {
-                            LOG("Error in Mouse Down: %s\n", lua_tostring(L, -1));
-                            lua_pop(L, 1); // Remove error message from the stack
-                        }
-                    }
-                    else
-                    {
-                        lua_pop(L, 1); // Remove non-function value from the stack
-                    }
-                }
-            }
-            else if (e.type == SDL_MOUSEBUTTONUP)
-            {
-                int luaButton = 0; // Initialize luaButton to 0 (invalid)
-
-                // Map SDL button codes to desired Lua button numbers
-                switch (e.button.button)
-                {
-                case SDL_BUTTON_LEFT:
-                    luaButton = 1; // Left button
-                    break;
-                case SDL_BUTTON_RIGHT:
-                    luaButton = 2; // Right button
-                    break;
-                case SDL_BUTTON_MIDDLE:
-                    luaButton = 3; // Middle button
-                    break;
-                default:
-                    // If it's not left, right, or middle button, do nothing
-                    break;
-                }
-
-                // Proceed only if luaButton is valid (1, 2, or 3)
-                if (luaButton != 0)
-                {
-                    lua_getglobal(L, "mouseUp"); // Get the 'mouseUp' function from Lua
-
-                    if (lua_isfunction(L, -1))
-                    {
-                        lua_pushinteger(L, luaButton); // Push the mapped button number to Lua
-
-                        // Call the Lua function with 1 argument and 0 return values
-                        if (lua_pcall(L, 1, 0, 0) != LUA_OK)
-                        {
-                            LOG("Error in Mouse Up: %s\n", lua_tostring(L, -1));
-                            lua_pop(L, 1); // Remove error message from the stack
-                        }
-                    }
-                    else
-                    {
-                        lua_pop(L, 1); // Remove non-function value from the stack
-                    }
-                }
-            }
+            char path[1024];
+            snprintf(path, sizeof(path), "%s.bmp", options.output);
+            SaveFrame(path);
         }
+    }
 
-        // Update pixels by calling Lua's update function with deltaTime
-        UpdatePixelsFromLua(deltaTime);
-
-        // Swap front and back buffers
-        Uint32 *temp = pixelsFront;
-        pixelsFront = pixelsBack;
-        pixelsBack = temp;
-
-        // Clear the back buffer
-        memset(pixelsBack, 0, bufferWidth * bufferHeight * sizeof(Uint32));
-
-        // Render the front buffer
-        DrawBuffer();
-
-        // Frame end time
-        Uint64 frameEnd = SDL_GetPerformanceCounter();
-        double frameDuration = (double)(frameEnd - frameStart) / (double)SDL_GetPerformanceFrequency();
-
-        // Retrieve 'fps' from Lua
-        lua_getglobal(L, "fps");
-        if (lua_isnumber(L, -1))
-        {
-            double fps = lua_tonumber(L, -1);
-            if (fps > 0.0)
-            {
-                desiredFrameTime = 1.0 / fps;
-
-                if (frameDuration < desiredFrameTime)
-                {
-                    double delayTimeSec = desiredFrameTime - frameDuration;
-                    Uint32 delayTimeMs = (Uint32)(delayTimeSec * 1000.0);
-                    if (delayTimeMs > 0)
-                    {
-                        SDL_Delay(delayTimeMs);
-                    }
-                }
-            }
-            else
-            {
-                // If fps is zero or negative, run as fast as possible
-                // No delay
-            }
-        }
+    if (options.tracePath)
+    {
+        if (SaveTrace(options.tracePath))
+            printf("Trace saved to %s\n", options.tracePath);
         else
-        {
-            // 'fps' not set or not a number, run as fast as possible
-            // No delay
-        }
-        lua_pop(L, 1); // Remove 'fps' from the stack
+            LOG("Failed to save %s\n", options.tracePath);
     }
 
     // Clean up
+    StopProfiler();
+    ClearProfile();
+    free(tracer.events);
+    FreeDeferred();
+    FreeEvents();
+    CloseParallelShader();
+    StopWorkerPool();
+    StopAssetLoader();
+    CloseRom();
     free(pixelsFront);
-    free(pixelsBack);
-    SDL_DestroyTexture(texture);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
+    if (!lockedRendering)
+        free(pixelsBack); // Otherwise it points into the texture
+    if (pipelined)
+        StopPipeline();
+    if (!headless)
+    {
+        SDL_DestroyTexture(texture);
+        SDL_DestroyRenderer(renderer);
+    }
+    if (!headless)
+        SDL_DestroyWindow(window);
     lua_close(L);
     SDL_FreeFormat(globalFormat);
     SDL_Quit();
 
     return 0;
 }
+#endif